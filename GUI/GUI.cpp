@@ -4,17 +4,20 @@
 #include <QToolButton>
 #include <QFileDialog>
 #include <qfilesystemmodel.h>
-#include <qtextbrowser.h>
 #include <string>
 #include "GUI.h"
+#include "ResultWriter.h"
+#include "ResultBrowser.h"
 
 GUI::GUI(QWidget* parent) : QMainWindow(parent)
 {
     ui.setupUi(this);
 
     ui.progressBar->setVisible(false);
+    ui.buttonCancel->setVisible(false);
     ui.SpinBoxSlice->setValue(8192);
     ui.pushButtonSave->setDisabled(true);
+    this->progress_timer.setInterval(100);
 
     connect(ui.listWidgetHex, &QListWidget::itemDoubleClicked, [this](QListWidgetItem* item) {
         this->current_item = item;
@@ -39,12 +42,14 @@ GUI::GUI(QWidget* parent) : QMainWindow(parent)
                     {
                         this->current_item_text = current_item->text();
                         current_item->setToolTip(current_item_text + "  (hex)");
+                        this->forgetPatternId(ui.listWidgetHex->row(current_item));
                     }
                 }
                 else
                 {
                     this->current_item_text = current_item->text();
                     current_item->setToolTip(current_item_text);
+                    this->forgetPatternId(ui.listWidgetHex->row(current_item));
                 }
             }
         }
@@ -67,12 +72,14 @@ GUI::GUI(QWidget* parent) : QMainWindow(parent)
                     {
                         this->current_item_text = current_item->text();
                         current_item->setToolTip(current_item_text + "  (hex)");
+                        this->forgetPatternId(ui.listWidgetHex->row(current_item));
                     }
                 }
                 else
                 {
                     this->current_item_text = current_item->text();
                     current_item->setToolTip(current_item_text);
+                    this->forgetPatternId(ui.listWidgetHex->row(current_item));
                 }
             }
         }
@@ -138,6 +145,19 @@ GUI::GUI(QWidget* parent) : QMainWindow(parent)
     });
     connect(ui.buttonExecute, &QPushButton::clicked, [this]() {this->exec(ui.SpinBoxSlice->value()); });
     connect(ui.pushButtonSave, &QPushButton::clicked, this, &GUI::saveButtonClicked);
+    connect(ui.buttonCancel, &QPushButton::clicked, [this]() {
+        if (this->progress)
+            this->progress->cancelled = true;
+        ui.buttonCancel->setDisabled(true);
+    });
+    connect(&this->progress_timer, &QTimer::timeout, this, &GUI::updateProgress);
+    connect(&this->watcher, &QFutureWatcher<SearchRes>::finished, this, &GUI::searchFinished);
+}
+GUI::~GUI()
+{
+    if (this->progress)
+        this->progress->cancelled = true;
+    this->watcher.waitForFinished();
 }
 
 void GUI::showMessageWindow(const QString& msg)
@@ -151,7 +171,10 @@ void GUI::provideQListWidgetContextMenu(const QPoint& pos, QListWidget* ptr)
 {
     QMenu submenu;
     submenu.addAction(ui.cyrillicLabel2->text(), [ptr, this]() {
-        this->seqtype.erase(std::next(this->seqtype.begin(), ptr->row(ptr->currentItem())));
+        auto row = ptr->row(ptr->currentItem());
+        this->seqtype.erase(std::next(this->seqtype.begin(), row));
+        if (row < this->pattern_ids.size())
+            this->pattern_ids.erase(std::next(this->pattern_ids.begin(), row));
         qDeleteAll(ptr->selectedItems());});
     submenu.exec(ptr->mapToGlobal(pos));
 }
@@ -174,49 +197,149 @@ void GUI::provideQTreeWidgetContextMenu(const QPoint& pos, QTreeWidget* ptr)
         auto item_parent_ptr = item_ptr->parent();
         if (item_parent_ptr != nullptr)
         {
-            auto textbrows = new QTextBrowser{};
-            textbrows->setWindowTitle(ui.cyrillicLabel10->text());
-            textbrows->insertPlainText(printFileResult(item_ptr->text(1)));
-            textbrows->resize(500, 500);
-            textbrows->showNormal();
+            auto file = this->res_data.find_file(item_ptr->text(1).toStdWString());
+            if (!file)
+            {
+                showMessageWindow(item_ptr->text(1) + " " + ui.cyrillicLabel9->text());
+                return;
+            }
+
+            std::vector<std::pair<PatternId, QString>> patterns{};
+            for (int i = 0; i != ui.listWidgetHex->count(); ++i)
+                if (i < this->pattern_ids.size() && this->pattern_ids.at(i))
+                    patterns.emplace_back(*this->pattern_ids.at(i), ui.listWidgetHex->item(i)->text());
+
+            auto browser = new ResultBrowser{ this->res_data, *file, patterns, ui.cyrillicLabel11->text() };
+            browser->setAttribute(Qt::WA_DeleteOnClose);
+            browser->setWindowTitle(ui.cyrillicLabel10->text() + ": " + item_ptr->text(1));
+            browser->resize(500, 500);
+            browser->showNormal();
+            this->result_windows.emplace_back(browser);
         }
     });
     if(this->res_data.empty())
         showSearchResultAction->setEnabled(false);
+    if (this->watcher.isRunning())
+        deleteAction->setEnabled(false);
     submenu.exec(ptr->mapToGlobal(pos));
 }
 void GUI::exec(size_t slice)
 {
+    this->closeResultWindows();
     this->res_data.reset();
     this->search.reset();
     this->fillPaths();
     this->fillHexes();
     if (!this->search.ready())
         return;
+    this->search.set_context_size(ui.SpinBoxContext->value());
+    this->search.set_dedup(ui.checkBoxDedup->isChecked() ? Dedup::Content : Dedup::None);
+    this->search.set_read_mode(ui.checkBoxDirect->isChecked() ? ReadMode::Direct : ReadMode::Buffered);
+    this->search.set_max_mismatches(ui.SpinBoxMismatches->value());
+    this->search.set_memory_budget(static_cast<size_t>(ui.SpinBoxBudget->value()) << 20);
     this->setWidgetsDisabled(true);
+    ui.progressBar->setValue(0);
     ui.progressBar->setVisible(true);
-    auto size_ = this->search.size();
-    auto cb = [this](auto value) {ui.progressBar->setValue(value); };
-    auto i = std::atomic<unsigned>(0);
-    auto t = QtConcurrent::run([this, slice, cb, &i] { return this->search.exec_and_reset(slice, i); });
-    while (!t.isFinished())
+    ui.buttonCancel->setEnabled(true);
+    ui.buttonCancel->setVisible(true);
+
+    this->tree_items.clear();
+    for (QTreeWidgetItemIterator it{ ui.treeWidgetPaths }; *it; ++it)
+    {
+        if ((*it)->parent() != nullptr)
+        {
+            (*it)->setText(2, {});
+            this->tree_items.insert((*it)->text(1), *it);
+        }
+    }
+
+    this->files_total = this->search.size();
+    this->res_data = SearchRes{ this->search.patterns(), static_cast<size_t>(ui.SpinBoxContext->value()), static_cast<unsigned>(ui.SpinBoxMismatches->value()) };
+    this->progress = std::make_unique<SearchProgress>();
+    auto on_file = [this](Path path, FileMatches matches) {
+        QMetaObject::invokeMethod(this, [this, path = std::move(path), matches = std::move(matches)]() mutable {
+            this->addFileResult(std::move(path), std::move(matches));
+        }, Qt::QueuedConnection);
+    };
+    this->watcher.setFuture(QtConcurrent::run([this, slice, on_file] { return this->search.exec_and_reset(slice, *this->progress, on_file); }));
+    this->progress_timer.start();
+}
+void GUI::updateProgress()
+{
+    if (!this->progress)
+        return;
+
+    auto total = this->progress->total_bytes.load();
+    auto value = total != 0 ? (this->progress->bytes.load() * 100) / total : (this->progress->files.load() * 100) / std::max<size_t>(this->files_total, 1);
+    ui.progressBar->setValue(static_cast<int>(value));
+}
+void GUI::searchFinished()
+{
+    this->progress_timer.stop();
+    try
+    {
+        auto res = this->watcher.future().takeResult();
+        if (res.unopened_files())
+        {
+            for (const auto& path : *res.unopened_files())
+            {
+                this->res_data.add_unopened(path);
+                if (auto item = this->tree_items.value(QString::fromStdWString(path), nullptr))
+                    item->setText(2, ui.cyrillicLabel9->text());
+            }
+        }
+    }
+    catch (const std::exception& e)
     {
-        auto res = (i.load() * 100) / size_;
-        ui.progressBar->setValue(res);
-        QApplication::processEvents();
+        qDebug() << e.what();
     }
 
-    this->res_data = t.takeResult();
+    this->tree_items.clear();
     ui.progressBar->setValue(0);
     ui.progressBar->setVisible(false);
+    ui.buttonCancel->setVisible(false);
     this->setWidgetsDisabled(false);
 }
+void GUI::addFileResult(Path path, FileMatches matches)
+{
+    auto hits = matches.positions.size();
+    auto item = this->tree_items.value(QString::fromStdWString(path), nullptr);
+    try
+    {
+        this->res_data.add_file(std::move(path), std::move(matches));
+    }
+    catch (const std::exception& e)
+    {
+        qDebug() << e.what();
+        return;
+    }
+    if (item)
+        item->setText(2, QString::number(hits));
+}
 
 void GUI::saveButtonClicked()
 {
     auto filedialog = new QFileDialog{ this };
     filedialog->setDefaultSuffix("txt");
-    QFile file(filedialog->getSaveFileName(this, {}, "*.txt", "text file (*.txt)"));
+    auto filename = filedialog->getSaveFileName(this, {}, "*.txt", "text file (*.txt);;CSV (*.csv);;NDJSON (*.ndjson);;binary (*.hxrs)");
+    if (filename.isEmpty())
+        return;
+
+    auto format = ResultWriter::format_by_extension(filename.toStdWString());
+    if (format)
+    {
+        try
+        {
+            ResultWriter{ this->res_data, *format }.write(filename.toStdWString());
+        }
+        catch (const std::exception& e)
+        {
+            qDebug() << e.what();
+        }
+        return;
+    }
+
+    QFile file(filename);
     if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
         return;
     QTextStream out(&file);
@@ -257,6 +380,7 @@ void GUI::fillPaths() noexcept
 }
 void GUI::fillHexes() noexcept
 {
+    this->pattern_ids.clear();
     try
     {
         for (int i = 0; i != ui.listWidgetHex->count(); ++i)
@@ -265,9 +389,9 @@ void GUI::fillHexes() noexcept
                 throw std::logic_error("Undefined behavior");
 
             if (this->seqtype.at(i) == SequenceType::IsHex)
-                this->search.add_bytes(RawBytes::make_hex(ui.listWidgetHex->item(i)->text().toStdString()).value());
+                this->pattern_ids.push_back(this->search.add_bytes(RawBytes::make_hex(ui.listWidgetHex->item(i)->text().toStdString()).value()));
             else
-                this->search.add_bytes(RawBytes{ ui.listWidgetHex->item(i)->text().toStdWString() });
+                this->pattern_ids.push_back(this->search.add_bytes(RawBytes{ ui.listWidgetHex->item(i)->text().toStdWString() }));
         }
     }
     catch (const std::exception& e)
@@ -287,37 +411,37 @@ void GUI::setWidgetsDisabled(bool f) noexcept
     ui.buttonExecute->setDisabled(f);
     ui.lineEditHex->setDisabled(f);
     ui.SpinBoxSlice->setDisabled(f);
+    ui.SpinBoxContext->setDisabled(f);
+    ui.SpinBoxMismatches->setDisabled(f);
+    ui.SpinBoxBudget->setDisabled(f);
+    ui.checkBoxDedup->setDisabled(f);
+    ui.checkBoxDirect->setDisabled(f);
     ui.listWidgetHex->setDisabled(f);
-    ui.treeWidgetPaths->setDisabled(f);
     ui.checkBoxIsHex->setDisabled(f);
 }
 QString GUI::printFileResult(const QString& path)
-{;
+{
     QString qstr{};
-    if (this->res_data.contains(path.toStdWString()))
+    auto file = this->res_data.find_file(path.toStdWString());
+    if (file)
     {
         qstr.append(ui.cyrillicLabel5->text()).append("\n").append(path).append("\n");
         for (int i = 0; i != ui.listWidgetHex->count(); ++i)
         {
             try
             {
-                PositionsInFile positions;
-                if (this->seqtype.at(i) == SequenceType::Unknown)
-                    throw std::logic_error("Undefined behavior");
+                if (i >= this->pattern_ids.size() || !this->pattern_ids.at(i))
+                    continue;
 
-                if(this->seqtype.at(i) == SequenceType::IsHex)
-                    positions = this->res_data.at(path.toStdWString(), RawBytes::make_hex(ui.listWidgetHex->item(i)->text().toStdString()).value());
-                else
-                {
-                    auto check = ui.listWidgetHex->item(i)->text().toStdWString();
-                    positions = this->res_data.at(path.toStdWString(), RawBytes{ check });
-                }
+                auto pattern = *this->pattern_ids.at(i);
+                auto hits = this->res_data.hits(*file, pattern);
                 qstr.append(ui.cyrillicLabel6->text()).append(" ").append(ui.listWidgetHex->item(i)->text()).append(" ");
-                if (!positions.empty())
+                if (hits != 0)
                 {
                     qstr.append(ui.cyrillicLabel7->text()).append(" \n");
-                    for (auto e : positions)
-                        qstr.append(QString::number(e)).append("    ");
+                    this->res_data.for_each_hit(*file, pattern, 0, hits, [&qstr](const MatchHit& hit) {
+                        qstr.append(QString::number(hit.position)).append("    ");
+                    });
                 }
                 else
                     qstr.append(ui.cyrillicLabel8->text());
@@ -339,3 +463,15 @@ QString GUI::printFileResult(const QString& path)
 
     return qstr;
 }
+void GUI::forgetPatternId(int row) noexcept
+{
+    if (row >= 0 && row < this->pattern_ids.size())
+        this->pattern_ids.at(row).reset();
+}
+void GUI::closeResultWindows() noexcept
+{
+    for (auto& window : this->result_windows)
+        if (window)
+            window->close();
+    this->result_windows.clear();
+}
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <QtWidgets/QMainWindow>
+#include <QPointer>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QTimer>
+#include <memory>
 #include "ui_GUI.h"
 #include "HexCore.h"
 
@@ -10,6 +15,7 @@ class GUI : public QMainWindow
 
 public:
     GUI(QWidget* parent = Q_NULLPTR);
+    ~GUI();
     void showMessageWindow(const QString&);
     void provideQListWidgetContextMenu(const QPoint&, QListWidget*);
     void provideQTreeWidgetContextMenu(const QPoint&, QTreeWidget*);
@@ -18,12 +24,17 @@ public:
 
 public slots:
     void saveButtonClicked();
+    void updateProgress();
+    void searchFinished();
 
 private:
     void fillPaths() noexcept;
     void fillHexes() noexcept;
     void setWidgetsDisabled(bool) noexcept;
     QString printFileResult(const QString&);
+    void addFileResult(Path, FileMatches);
+    void closeResultWindows() noexcept;
+    void forgetPatternId(int) noexcept;
 
     enum class SequenceType {IsHex, IsText, Unknown};
 
@@ -34,4 +45,11 @@ private:
     Search search{};
     SearchRes res_data{};
     std::vector<SequenceType> seqtype{};
+    std::vector<std::optional<PatternId>> pattern_ids{};
+    std::vector<QPointer<QWidget>> result_windows{};
+    std::unique_ptr<SearchProgress> progress{};
+    QFutureWatcher<SearchRes> watcher{};
+    QTimer progress_timer{};
+    QHash<QString, QTreeWidgetItem*> tree_items{};
+    size_t files_total{ 0 };
 };
@@ -0,0 +1,151 @@
+#include <QByteArray>
+#include <QComboBox>
+#include <QHeaderView>
+#include <QLineEdit>
+#include <QTableView>
+#include <QVBoxLayout>
+#include <algorithm>
+#include <limits>
+#include "ResultBrowser.h"
+
+ResultModel::ResultModel(const SearchRes& res, FileId file, QObject* parent) : QAbstractTableModel(parent), res{ res }, file{ file }
+{
+}
+
+int ResultModel::rowCount(const QModelIndex& parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return static_cast<int>(std::min<size_t>(this->hits(), std::numeric_limits<int>::max()));
+}
+int ResultModel::columnCount(const QModelIndex& parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return 2 + (this->res.max_mismatches() != 0 ? 1 : 0) + (this->res.context_size() != 0 ? 1 : 0);
+}
+QVariant ResultModel::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid() || !this->pattern || role != Qt::DisplayRole)
+        return {};
+
+    const auto& row = this->row(index.row());
+    auto pos = static_cast<qulonglong>(row.position);
+    if (index.column() == 0)
+        return QString::number(pos);
+    if (index.column() == 1)
+        return QString("0x%1").arg(pos, 0, 16);
+    if (index.column() == 2 && this->res.max_mismatches() != 0)
+        return row.distance;
+
+    return QString("%1 | %2").arg(QString::fromLatin1(row.before.toHex(' ')), QString::fromLatin1(row.after.toHex(' ')));
+}
+QVariant ResultModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (role != Qt::DisplayRole)
+        return {};
+    if (orientation == Qt::Vertical)
+        return section + 1;
+    if (section == 2 && this->res.max_mismatches() != 0)
+        return QString("distance");
+    if (section >= 2)
+        return QString("context");
+    return section == 0 ? QString("dec") : QString("hex");
+}
+void ResultModel::setPattern(PatternId pattern)
+{
+    beginResetModel();
+    this->pattern = pattern;
+    this->page.clear();
+    endResetModel();
+}
+QModelIndex ResultModel::indexOfOffset(uintmax_t offset) const
+{
+    size_t count = this->rowCount();
+    if (count == 0)
+        return {};
+
+    // Hits are sorted by position; the search only reads the pages it lands on.
+    size_t first = 0, last = count;
+    while (first != last)
+    {
+        auto middle = first + (last - first) / 2;
+        if (this->row(middle).position < offset)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    if (first == count)
+        --first;
+    return index(static_cast<int>(first), 0);
+}
+
+size_t ResultModel::hits() const
+{
+    if (!this->pattern)
+        return 0;
+    return this->res.hits(this->file, *this->pattern);
+}
+const ResultModel::Row& ResultModel::row(size_t i) const
+{
+    if (this->page.empty() || i < this->page_first || i >= this->page_first + this->page.size())
+    {
+        this->page.clear();
+        this->page_first = i / page_size * page_size;
+        auto last = std::min(this->page_first + page_size, this->hits());
+        this->page.reserve(last - this->page_first);
+        this->res.for_each_hit(this->file, *this->pattern, this->page_first, last, [this](const MatchHit& hit) {
+            this->page.push_back({ hit.position, hit.distance,
+                QByteArray(hit.context.before.data(), static_cast<int>(hit.context.before.size())),
+                QByteArray(hit.context.after.data(), static_cast<int>(hit.context.after.size())) });
+        });
+    }
+    return this->page[i - this->page_first];
+}
+
+ResultBrowser::ResultBrowser(const SearchRes& res, FileId file, const std::vector<std::pair<PatternId, QString>>& patterns, const QString& jumpText, QWidget* parent) : QWidget(parent)
+{
+    this->model = new ResultModel{ res, file, this };
+    this->comboBoxPattern = new QComboBox{ this };
+    this->lineEditOffset = new QLineEdit{ this };
+    this->tableView = new QTableView{ this };
+
+    for (const auto& [id, text] : patterns)
+        this->comboBoxPattern->addItem(QString("%1 (%2%3)").arg(text).arg(res.hits(file, id)).arg(res.truncated(file, id) ? "+" : ""), QVariant::fromValue<qulonglong>(id));
+    this->lineEditOffset->setPlaceholderText(jumpText);
+
+    this->tableView->setModel(this->model);
+    this->tableView->setSelectionBehavior(QAbstractItemView::SelectRows);
+    this->tableView->verticalHeader()->setSectionResizeMode(QHeaderView::Fixed);
+    this->tableView->verticalHeader()->setDefaultSectionSize(this->tableView->fontMetrics().height() + 4);
+    this->tableView->horizontalHeader()->setStretchLastSection(true);
+
+    auto layout = new QVBoxLayout{ this };
+    layout->addWidget(this->comboBoxPattern);
+    layout->addWidget(this->lineEditOffset);
+    layout->addWidget(this->tableView);
+
+    connect(this->comboBoxPattern, QOverload<int>::of(&QComboBox::currentIndexChanged), [this](int i) {
+        if (i >= 0)
+            this->model->setPattern(static_cast<PatternId>(this->comboBoxPattern->itemData(i).toULongLong()));
+    });
+    connect(this->lineEditOffset, &QLineEdit::returnPressed, this, &ResultBrowser::jumpToOffset);
+
+    if (this->comboBoxPattern->count() != 0)
+        this->model->setPattern(static_cast<PatternId>(this->comboBoxPattern->itemData(0).toULongLong()));
+}
+
+void ResultBrowser::jumpToOffset()
+{
+    auto text = this->lineEditOffset->text().trimmed();
+    bool ok = false;
+    auto offset = text.startsWith("0x", Qt::CaseInsensitive) ? text.mid(2).toULongLong(&ok, 16) : text.toULongLong(&ok, 10);
+    if (!ok)
+        return;
+
+    auto index = this->model->indexOfOffset(offset);
+    if (!index.isValid())
+        return;
+    this->tableView->scrollTo(index, QAbstractItemView::PositionAtTop);
+    this->tableView->selectRow(index.row());
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <QAbstractTableModel>
+#include <QByteArray>
+#include <QWidget>
+#include "HexCore.h"
+
+class QComboBox;
+class QLineEdit;
+class QTableView;
+
+// Exposes the hits of one (file, pattern) pair straight from SearchRes; rows are formatted
+// only when the view asks for them. Hits are read a page at a time with for_each_hit, so a
+// pair spilled to disk is never loaded whole. Everything is looked up by id, so the model
+// stays valid while the search keeps adding files to SearchRes.
+class ResultModel : public QAbstractTableModel
+{
+    Q_OBJECT
+
+public:
+    ResultModel(const SearchRes&, FileId, QObject* parent = Q_NULLPTR);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    int columnCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex&, int role = Qt::DisplayRole) const override;
+    QVariant headerData(int, Qt::Orientation, int role = Qt::DisplayRole) const override;
+
+    void setPattern(PatternId);
+    QModelIndex indexOfOffset(uintmax_t) const;
+
+private:
+    struct Row
+    {
+        uintmax_t position;
+        unsigned distance;
+        QByteArray before;
+        QByteArray after;
+    };
+    static constexpr size_t page_size = 1024;
+
+    const SearchRes& res;
+    FileId file;
+    std::optional<PatternId> pattern{};
+    mutable size_t page_first = 0;
+    mutable std::vector<Row> page{};
+
+    size_t hits() const;
+    const Row& row(size_t) const;
+};
+
+class ResultBrowser : public QWidget
+{
+    Q_OBJECT
+
+public:
+    ResultBrowser(const SearchRes&, FileId, const std::vector<std::pair<PatternId, QString>>&, const QString&, QWidget* parent = Q_NULLPTR);
+
+private:
+    void jumpToOffset();
+
+private:
+    ResultModel* model;
+    QComboBox* comboBoxPattern;
+    QLineEdit* lineEditOffset;
+    QTableView* tableView;
+};
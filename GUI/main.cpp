@@ -1,12 +1,22 @@
 #include "GUI.h"
+#include "Shard.h"
 #include <QtWidgets/QApplication>
+#include <QCoreApplication>
 #include <iostream>
 
 int main(int argc, char *argv[])
 {
+    // Worker process of a sharded search, started by ShardCoordinator.
+    if (argc == 4 && std::string_view{ argv[1] } == "--shard-worker")
+    {
+        QCoreApplication app(argc, argv);
+        auto args = app.arguments();
+        return ShardCoordinator::run_worker(args[2].toStdWString(), args[3].toStdWString()) ? 0 : 1;
+    }
+
     QApplication a(argc, argv);
     GUI w;
     w.show();
 
     return a.exec();
-}
\ No newline at end of file
+}
@@ -0,0 +1,97 @@
+#include <bit>
+#include <stdexcept>
+#include "ApproximateMatcher.h"
+
+ApproximateMatcher::ApproximateMatcher(const std::vector<char>& pattern, unsigned k)
+	: size{ pattern.size() }, max_mismatches{ k }, field_bits{ static_cast<unsigned>(std::bit_width(k)) + 1 }
+{
+	if (pattern.empty())
+		throw std::logic_error("Empty pattern");
+	if (this->field_bits > 32)
+		throw std::logic_error("Too many mismatches");
+
+	this->fields_per_word = 64 / this->field_bits;
+	this->words = (this->size + this->fields_per_word - 1) / this->fields_per_word;
+	this->field_mask = this->field_bits == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << this->field_bits) - 1;
+	this->overflow_mask = 0;
+	for (std::size_t f = 0; f != this->fields_per_word; ++f)
+		this->overflow_mask |= uint64_t{ 1 } << (f * this->field_bits + this->field_bits - 1);
+
+	// Field j of the table entry for byte c is 1 when pattern[j] != c.
+	this->mismatch_table.assign(256 * this->words, 0);
+	for (unsigned c = 0; c != 256; ++c)
+	{
+		for (std::size_t j = 0; j != this->size; ++j)
+		{
+			if (static_cast<unsigned char>(pattern[j]) == c)
+				continue;
+			auto word = j / this->fields_per_word;
+			auto field = j % this->fields_per_word;
+			this->mismatch_table[c * this->words + word] |= uint64_t{ 1 } << (field * this->field_bits);
+		}
+	}
+}
+const char* ApproximateMatcher::find(const char* first, const char* last, unsigned& distance) const
+{
+	if (static_cast<std::size_t>(last - first) < this->size)
+		return nullptr;
+
+	const auto top_shift = (this->fields_per_word - 1) * this->field_bits;
+	const auto used_mask = this->fields_per_word * this->field_bits == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << (this->fields_per_word * this->field_bits)) - 1;
+	const auto last_word = this->words - 1;
+	const auto last_shift = ((this->size - 1) % this->fields_per_word) * this->field_bits;
+
+	// Alignments that started before `first` are marked overflowed, so the first
+	// size - 1 bytes only fill the pipeline.
+	if (this->words == 1)
+	{
+		uint64_t state = 0, overflow = this->overflow_mask;
+		for (const char* it = first; it != last; ++it)
+		{
+			auto s = ((state << this->field_bits) & used_mask) + this->mismatch_table[static_cast<unsigned char>(*it)];
+			overflow = ((overflow << this->field_bits) & used_mask) | (s & this->overflow_mask);
+			state = s & ~this->overflow_mask;
+			if (static_cast<std::size_t>(it - first) + 1 < this->size || ((overflow >> last_shift) & this->field_mask))
+				continue;
+			auto count = static_cast<unsigned>((state >> last_shift) & this->field_mask);
+			if (count <= this->max_mismatches)
+			{
+				distance = count;
+				return it + 1 - this->size;
+			}
+		}
+		return nullptr;
+	}
+
+	std::vector<uint64_t> state(this->words, 0);
+	std::vector<uint64_t> overflow(this->words, this->overflow_mask);
+
+	for (const char* it = first; it != last; ++it)
+	{
+		const uint64_t* row = this->mismatch_table.data() + static_cast<unsigned char>(*it) * this->words;
+		uint64_t carry_state = 0, carry_overflow = 0;
+		for (std::size_t w = 0; w != this->words; ++w)
+		{
+			auto next_carry_state = (state[w] >> top_shift) & this->field_mask;
+			auto next_carry_overflow = (overflow[w] >> top_shift) & this->field_mask;
+			auto s = (((state[w] << this->field_bits) | carry_state) & used_mask) + row[w];
+			overflow[w] = (((overflow[w] << this->field_bits) | carry_overflow) & used_mask) | (s & this->overflow_mask);
+			state[w] = s & ~this->overflow_mask;
+			carry_state = next_carry_state;
+			carry_overflow = next_carry_overflow;
+		}
+
+		if (static_cast<std::size_t>(it - first) + 1 < this->size)
+			continue;
+		if ((overflow[last_word] >> last_shift) & this->field_mask)
+			continue;
+		auto count = static_cast<unsigned>((state[last_word] >> last_shift) & this->field_mask);
+		if (count <= this->max_mismatches)
+		{
+			distance = count;
+			return it + 1 - this->size;
+		}
+	}
+
+	return nullptr;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Finds a pattern with at most k substituted bytes (Hamming distance) using the Shift-Add
+// algorithm: every alignment of the pattern keeps its mismatch count in a field of
+// bit_width(k) + 1 bits, and all fields are updated together with one shift and one add
+// per text byte. A field that reaches 2^bit_width(k) mismatches overflows into a sticky
+// bit, so counts never spill into the neighbouring field. Patterns longer than one
+// machine word of fields span several words; a scan costs O(n * words).
+class __declspec(dllexport) ApproximateMatcher
+{
+public:
+	ApproximateMatcher() = delete;
+	ApproximateMatcher(const ApproximateMatcher&) = default;
+	ApproximateMatcher(ApproximateMatcher&&) = default;
+	~ApproximateMatcher() = default;
+	ApproximateMatcher& operator=(const ApproximateMatcher&) = default;
+	ApproximateMatcher& operator=(ApproximateMatcher&&) = default;
+
+	ApproximateMatcher(const std::vector<char>&, unsigned);
+
+	// First match that lies entirely in [first, last); its distance goes to the last argument.
+	const char* find(const char*, const char*, unsigned&) const;
+
+private:
+	std::size_t size;
+	unsigned max_mismatches;
+	unsigned field_bits;
+	std::size_t fields_per_word;
+	std::size_t words;
+	uint64_t field_mask;
+	uint64_t overflow_mask;
+	std::vector<uint64_t> mismatch_table;
+};
@@ -0,0 +1,133 @@
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <vector>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+#include "FileIdentity.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	inline uint64_t rotl(uint64_t x, int r) noexcept
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	inline uint64_t fmix(uint64_t k) noexcept
+	{
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdull;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ull;
+		k ^= k >> 33;
+		return k;
+	}
+}
+
+std::size_t FileIdentityHasher::operator()(const FileIdentity& id) const noexcept
+{
+	return static_cast<std::size_t>(fmix(id.device * 0x9e3779b97f4a7c15ull ^ id.index));
+}
+
+std::optional<FileIdentity> identify_file(const Path& path) noexcept
+{
+#ifdef _WIN32
+	HANDLE handle = CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return {};
+	BY_HANDLE_FILE_INFORMATION info{};
+	bool ok = GetFileInformationByHandle(handle, &info);
+	CloseHandle(handle);
+	if (!ok)
+		return {};
+	return FileIdentity{ info.dwVolumeSerialNumber, (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow };
+#else
+	struct stat st {};
+	if (stat(fs::path{ path }.c_str(), &st) != 0)
+		return {};
+	return FileIdentity{ static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino) };
+#endif
+}
+
+
+void ContentHasher::update(const char* data, std::size_t size) noexcept
+{
+	this->length += size;
+	if (this->tail_size != 0)
+	{
+		auto n = std::min(size, sizeof(this->tail) - this->tail_size);
+		std::memcpy(this->tail + this->tail_size, data, n);
+		this->tail_size += n;
+		data += n;
+		size -= n;
+		if (this->tail_size != sizeof(this->tail))
+			return;
+		uint64_t w;
+		std::memcpy(&w, this->tail, sizeof(w));
+		this->consume(w);
+		this->tail_size = 0;
+	}
+	for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t))
+	{
+		uint64_t w;
+		std::memcpy(&w, data, sizeof(w));
+		this->consume(w);
+	}
+	std::memcpy(this->tail, data, size);
+	this->tail_size = size;
+}
+ContentHash ContentHasher::digest() const noexcept
+{
+	uint64_t w = 0;
+	std::memcpy(&w, this->tail, this->tail_size);
+	uint64_t a = this->lanes[0] ^ rotl(w * 0x87c37b91114253d5ull, 31) ^ this->length;
+	uint64_t b = this->lanes[1] ^ rotl(w * 0x4cf5ad432745937full, 33) ^ (this->length << 1);
+	a += b;
+	b += a;
+	a = fmix(a);
+	b = fmix(b);
+	a += b;
+	b += a;
+	return { a, b };
+}
+std::optional<ContentHash> ContentHasher::hash_ends(const Path& path, std::size_t size) noexcept
+{
+	try
+	{
+		auto file_size = fs::file_size(fs::path{ path });
+		std::ifstream file{ fs::path{ path }, std::ios::binary };
+		if (!file)
+			return {};
+
+		ContentHasher hasher{};
+		std::vector<char> buff(file_size < 2 * size ? static_cast<std::size_t>(file_size) : size);
+		file.read(buff.data(), buff.size());
+		hasher.update(buff.data(), static_cast<std::size_t>(file.gcount()));
+		if (file_size > buff.size())
+		{
+			file.seekg(-static_cast<std::streamoff>(buff.size()), std::ios::end);
+			file.read(buff.data(), buff.size());
+			hasher.update(buff.data(), static_cast<std::size_t>(file.gcount()));
+		}
+		if (!file)
+			return {};
+		return hasher.digest();
+	}
+	catch (...)
+	{
+	}
+
+	return {};
+}
+void ContentHasher::consume(uint64_t w) noexcept
+{
+	this->lanes[0] = rotl(this->lanes[0] ^ (w * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+	this->lanes[1] = rotl(this->lanes[1] + (w * 0x52dce729ull), 29) * 0x87c37b91114253d5ull + this->lanes[0];
+}
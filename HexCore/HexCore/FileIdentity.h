@@ -0,0 +1,49 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+using Path = std::wstring;
+using ContentHash = std::array<uint64_t, 2>;
+
+// Device and file index as the OS sees them; two paths with equal identities are
+// hard links to the same data.
+struct FileIdentity
+{
+	uint64_t device;
+	uint64_t index;
+
+	bool operator==(const FileIdentity&) const noexcept = default;
+};
+
+struct __declspec(dllexport) FileIdentityHasher
+{
+	std::size_t operator()(const FileIdentity&) const noexcept;
+};
+
+__declspec(dllexport) std::optional<FileIdentity> identify_file(const Path&) noexcept;
+
+
+// Streaming 128-bit non-cryptographic hash. The digest depends only on the bytes fed in,
+// not on how they were split between update() calls.
+// Different data can have the same digest, and data crafted for it easily does, so a
+// digest only picks candidates: content deduplication compares the files themselves
+// before it treats one as a copy of another. A collision costs a comparison that fails,
+// never a wrong result.
+class __declspec(dllexport) ContentHasher
+{
+public:
+	void update(const char*, std::size_t) noexcept;
+	ContentHash digest() const noexcept;
+
+	static std::optional<ContentHash> hash_ends(const Path&, std::size_t) noexcept;
+
+private:
+	void consume(uint64_t) noexcept;
+
+	uint64_t lanes[2]{ 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full };
+	uint64_t length{ 0 };
+	char tail[8]{};
+	std::size_t tail_size{ 0 };
+};
@@ -0,0 +1,406 @@
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#include <malloc.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "FileReader.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	void free_aligned(void* p) noexcept
+	{
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		std::free(p);
+#endif
+	}
+
+	// Released AlignedBuffer blocks, freed at exit. The pool holds at most max_bytes, and
+	// blocks of a size nobody asks for any more are dropped first: a search uses one
+	// window size, so those belong to an earlier one.
+	struct BufferPool
+	{
+		static constexpr std::size_t max_bytes = std::size_t{ 64 } << 20;
+
+		std::mutex mutex{};
+		std::vector<std::pair<std::size_t, void*>> blocks{};
+		std::size_t bytes{ 0 };
+
+		// Frees blocks not of the given size, oldest first, until need more bytes fit
+		// under max_bytes. A need of max_bytes drops every such block.
+		void evict_other_sizes(std::size_t size, std::size_t need) noexcept
+		{
+			for (auto it = this->blocks.begin(); it != this->blocks.end() && this->bytes + need > max_bytes;)
+			{
+				if (it->first == size)
+				{
+					++it;
+					continue;
+				}
+				this->bytes -= it->first;
+				free_aligned(it->second);
+				it = this->blocks.erase(it);
+			}
+		}
+
+		~BufferPool()
+		{
+			for (auto& block : this->blocks)
+				free_aligned(block.second);
+		}
+	};
+
+	BufferPool pool{};
+}
+
+AlignedBuffer::AlignedBuffer(std::size_t size)
+{
+	size = (size + alignment - 1) / alignment * alignment;
+	{
+		std::lock_guard<std::mutex> lock{ pool.mutex };
+		auto it = std::find_if(pool.blocks.begin(), pool.blocks.end(), [size](const auto& e) { return e.first == size; });
+		if (it != pool.blocks.end())
+		{
+			this->ptr = static_cast<char*>(it->second);
+			this->capacity = size;
+			pool.bytes -= size;
+			pool.blocks.erase(it);
+			return;
+		}
+		pool.evict_other_sizes(size, BufferPool::max_bytes);
+	}
+	this->ptr = static_cast<char*>(allocate(size));
+	this->capacity = size;
+}
+AlignedBuffer::AlignedBuffer(AlignedBuffer&& other) noexcept : ptr{ other.ptr }, capacity{ other.capacity }
+{
+	other.ptr = nullptr;
+	other.capacity = 0;
+}
+AlignedBuffer& AlignedBuffer::operator=(AlignedBuffer&& other) noexcept
+{
+	if (this != &other)
+	{
+		this->release();
+		this->ptr = other.ptr;
+		this->capacity = other.capacity;
+		other.ptr = nullptr;
+		other.capacity = 0;
+	}
+	return *this;
+}
+AlignedBuffer::~AlignedBuffer()
+{
+	this->release();
+}
+char* AlignedBuffer::data() const noexcept
+{
+	return this->ptr;
+}
+std::size_t AlignedBuffer::size() const noexcept
+{
+	return this->capacity;
+}
+void AlignedBuffer::release() noexcept
+{
+	if (!this->ptr)
+		return;
+	try
+	{
+		std::lock_guard<std::mutex> lock{ pool.mutex };
+		pool.evict_other_sizes(this->capacity, this->capacity);
+		if (pool.bytes + this->capacity <= BufferPool::max_bytes)
+		{
+			pool.blocks.emplace_back(this->capacity, this->ptr);
+			pool.bytes += this->capacity;
+			this->ptr = nullptr;
+		}
+	}
+	catch (...)
+	{
+	}
+	if (this->ptr)
+		deallocate(this->ptr);
+	this->ptr = nullptr;
+	this->capacity = 0;
+}
+void* AlignedBuffer::allocate(std::size_t size)
+{
+#ifdef _WIN32
+	auto p = _aligned_malloc(size, alignment);
+#else
+	auto p = std::aligned_alloc(alignment, size);
+#endif
+	if (!p)
+		throw std::bad_alloc{};
+	return p;
+}
+void AlignedBuffer::deallocate(void* p) noexcept
+{
+	free_aligned(p);
+}
+
+NativeFile::NativeFile(const Path& path, ReadMode mode) : path{ path }
+{
+#ifdef _WIN32
+	DWORD flags = FILE_FLAG_SEQUENTIAL_SCAN;
+	if (mode == ReadMode::Direct)
+	{
+		this->handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, flags | FILE_FLAG_NO_BUFFERING, nullptr);
+		this->unbuffered = this->handle != INVALID_HANDLE_VALUE;
+	}
+	if (!this->unbuffered)
+		this->handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, flags, nullptr);
+	if (this->handle == INVALID_HANDLE_VALUE)
+	{
+		this->handle = nullptr;
+		throw std::runtime_error("Bad file access");
+	}
+#else
+	auto native = fs::path{ path }.string();
+#ifdef O_DIRECT
+	if (mode == ReadMode::Direct)
+	{
+		this->fd = ::open(native.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+		this->unbuffered = this->fd >= 0;
+	}
+#endif
+	if (!this->unbuffered)
+		this->fd = ::open(native.c_str(), O_RDONLY | O_CLOEXEC);
+	if (this->fd < 0)
+		throw std::runtime_error("Bad file access");
+#if defined(__APPLE__)
+	if (mode == ReadMode::Direct)
+		this->unbuffered = fcntl(this->fd, F_NOCACHE, 1) == 0;
+#else
+	posix_fadvise(this->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+}
+NativeFile::NativeFile(NativeFile&& other) noexcept : path{ std::move(other.path) }, unbuffered{ other.unbuffered }
+{
+#ifdef _WIN32
+	this->handle = other.handle;
+	other.handle = nullptr;
+#else
+	this->fd = other.fd;
+	other.fd = -1;
+#endif
+}
+NativeFile& NativeFile::operator=(NativeFile&& other) noexcept
+{
+	if (this != &other)
+	{
+		this->close();
+		this->path = std::move(other.path);
+		this->unbuffered = other.unbuffered;
+#ifdef _WIN32
+		this->handle = other.handle;
+		other.handle = nullptr;
+#else
+		this->fd = other.fd;
+		other.fd = -1;
+#endif
+	}
+	return *this;
+}
+NativeFile::~NativeFile()
+{
+	this->close();
+}
+std::size_t NativeFile::read_at(uintmax_t offset, char* dst, std::size_t size)
+{
+	std::size_t total = 0;
+	while (total != size)
+	{
+#ifdef _WIN32
+		OVERLAPPED overlapped{};
+		auto position = offset + total;
+		overlapped.Offset = static_cast<DWORD>(position);
+		overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+		DWORD read = 0;
+		auto chunk = static_cast<DWORD>(std::min<std::size_t>(size - total, 1u << 30));
+		if (!ReadFile(this->handle, dst + total, chunk, &read, &overlapped))
+		{
+			auto error = GetLastError();
+			if (error == ERROR_HANDLE_EOF)
+				break;
+			if (this->unbuffered && error == ERROR_INVALID_PARAMETER)
+			{
+				this->reopen_buffered();
+				continue;
+			}
+			throw std::runtime_error("Bad file access");
+		}
+#else
+		auto read = ::pread(this->fd, dst + total, size - total, static_cast<off_t>(offset + total));
+		if (read < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (this->unbuffered && errno == EINVAL)
+			{
+				this->reopen_buffered();
+				continue;
+			}
+			throw std::runtime_error("Bad file access");
+		}
+#endif
+		if (read == 0)
+			break;
+		total += static_cast<std::size_t>(read);
+		// An unbuffered read returns less than asked only at the end of file; asking again
+		// from an unaligned offset would be rejected.
+		if (this->unbuffered && total % AlignedBuffer::alignment != 0)
+			break;
+	}
+
+	return total;
+}
+void NativeFile::drop_cache(uintmax_t offset, uintmax_t size) noexcept
+{
+#if !defined(_WIN32) && !defined(__APPLE__)
+	if (!this->unbuffered && size != 0)
+		posix_fadvise(this->fd, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_DONTNEED);
+#else
+	(void)offset;
+	(void)size;
+#endif
+}
+bool NativeFile::direct() const noexcept
+{
+	return this->unbuffered;
+}
+void NativeFile::close() noexcept
+{
+#ifdef _WIN32
+	if (this->handle)
+		CloseHandle(this->handle);
+	this->handle = nullptr;
+#else
+	if (this->fd >= 0)
+		::close(this->fd);
+	this->fd = -1;
+#endif
+}
+// Some filesystems accept an unbuffered open but reject the reads (or only the
+// unaligned tail); the rest of the file is then read through the cache.
+void NativeFile::reopen_buffered()
+{
+	NativeFile file{ this->path, ReadMode::DropCache };
+	*this = std::move(file);
+}
+
+
+std::optional<std::vector<DataExtent>> data_extents(const Path& path, uintmax_t min_hole) noexcept
+{
+	try
+	{
+		std::vector<DataExtent> extents{};
+		auto add = [&extents, min_hole](uintmax_t begin, uintmax_t end) {
+			if (begin >= end)
+				return;
+			if (!extents.empty() && begin - extents.back().end < min_hole)
+				extents.back().end = end;
+			else
+				extents.push_back({ begin, end });
+		};
+
+		uintmax_t size = 0;
+#ifdef _WIN32
+		HANDLE handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (handle == INVALID_HANDLE_VALUE)
+			return {};
+		BY_HANDLE_FILE_INFORMATION info{};
+		if (!GetFileInformationByHandle(handle, &info) || !(info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE))
+		{
+			CloseHandle(handle);
+			return {};
+		}
+		size = (static_cast<uintmax_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+
+		FILE_ALLOCATED_RANGE_BUFFER query{};
+		query.FileOffset.QuadPart = 0;
+		query.Length.QuadPart = static_cast<LONGLONG>(size);
+		std::vector<FILE_ALLOCATED_RANGE_BUFFER> ranges(256);
+		for (;;)
+		{
+			DWORD returned = 0;
+			bool ok = DeviceIoControl(handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges.data(), static_cast<DWORD>(ranges.size() * sizeof(ranges[0])), &returned, nullptr);
+			if (!ok && GetLastError() != ERROR_MORE_DATA)
+			{
+				CloseHandle(handle);
+				return {};
+			}
+			auto count = returned / sizeof(ranges[0]);
+			for (size_t i = 0; i != count; ++i)
+				add(static_cast<uintmax_t>(ranges[i].FileOffset.QuadPart), static_cast<uintmax_t>(ranges[i].FileOffset.QuadPart + ranges[i].Length.QuadPart));
+			if (ok || count == 0)
+				break;
+			// Continue after the last range returned.
+			auto next = ranges[count - 1].FileOffset.QuadPart + ranges[count - 1].Length.QuadPart;
+			query.Length.QuadPart -= next - query.FileOffset.QuadPart;
+			query.FileOffset.QuadPart = next;
+		}
+		CloseHandle(handle);
+#elif defined(SEEK_DATA) && defined(SEEK_HOLE)
+		int fd = ::open(fs::path{ path }.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return {};
+		size = static_cast<uintmax_t>(::lseek(fd, 0, SEEK_END));
+		uintmax_t pos = 0;
+		while (pos < size)
+		{
+			auto data = ::lseek(fd, static_cast<off_t>(pos), SEEK_DATA);
+			if (data < 0)
+			{
+				// ENXIO: nothing but a hole up to the end; anything else: not supported.
+				if (errno == ENXIO)
+					break;
+				::close(fd);
+				return {};
+			}
+			auto hole = ::lseek(fd, data, SEEK_HOLE);
+			if (hole < 0)
+			{
+				::close(fd);
+				return {};
+			}
+			add(static_cast<uintmax_t>(data), static_cast<uintmax_t>(hole));
+			pos = static_cast<uintmax_t>(hole);
+		}
+		::close(fd);
+#else
+		return {};
+#endif
+
+		// Leading and trailing holes are trimmed by the same threshold as the inner ones.
+		if (!extents.empty() && extents.front().begin < min_hole)
+			extents.front().begin = 0;
+		if (!extents.empty() && size - extents.back().end < min_hole)
+			extents.back().end = size;
+		if (extents.size() == 1 && extents.front().begin == 0 && extents.front().end == size)
+			return {};
+		return extents;
+	}
+	catch (...)
+	{
+	}
+
+	return {};
+}
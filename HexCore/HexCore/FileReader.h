@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "FileIdentity.h"
+
+// How files are read. Buffered goes through std::ifstream and the page cache. DropCache
+// reads through the cache but tells the OS to evict every window once it is scanned
+// (posix_fadvise DONTNEED; a sequential-scan hint on Windows). Direct bypasses the cache
+// with O_DIRECT / FILE_FLAG_NO_BUFFERING and falls back to DropCache on filesystems
+// that refuse unbuffered reads.
+enum class ReadMode { Buffered, DropCache, Direct };
+
+// Memory aligned for unbuffered I/O. Released blocks are kept for reuse, so a search
+// that opens many files does not allocate a window buffer per file.
+class __declspec(dllexport) AlignedBuffer
+{
+public:
+	static constexpr std::size_t alignment = 4096;
+
+	AlignedBuffer() = default;
+	AlignedBuffer(const AlignedBuffer&) = delete;
+	AlignedBuffer(AlignedBuffer&&) noexcept;
+	~AlignedBuffer();
+	AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+	AlignedBuffer& operator=(AlignedBuffer&&) noexcept;
+
+	explicit AlignedBuffer(std::size_t);
+
+	char* data() const noexcept;
+	std::size_t size() const noexcept;
+
+private:
+	void release() noexcept;
+
+	static void* allocate(std::size_t);
+	static void deallocate(void*) noexcept;
+
+private:
+	char* ptr = nullptr;
+	std::size_t capacity = 0;
+};
+
+// Positional reads through the OS file API for the DropCache and Direct modes.
+class __declspec(dllexport) NativeFile
+{
+public:
+	NativeFile() = delete;
+	NativeFile(const NativeFile&) = delete;
+	NativeFile(NativeFile&&) noexcept;
+	~NativeFile();
+	NativeFile& operator=(const NativeFile&) = delete;
+	NativeFile& operator=(NativeFile&&) noexcept;
+
+	NativeFile(const Path&, ReadMode);
+
+	// In direct mode the offset, destination and size must be multiples of
+	// AlignedBuffer::alignment; a read at the end of file may return less.
+	std::size_t read_at(uintmax_t, char*, std::size_t);
+	void drop_cache(uintmax_t, uintmax_t) noexcept;
+	bool direct() const noexcept;
+
+private:
+	void close() noexcept;
+	void reopen_buffered();
+
+private:
+	Path path;
+#ifdef _WIN32
+	void* handle = nullptr;
+#else
+	int fd = -1;
+#endif
+	bool unbuffered = false;
+};
+
+
+// Allocated byte range [begin, end) of a sparse file; everything between two extents is a
+// hole that reads as zeros.
+struct DataExtent
+{
+	uintmax_t begin;
+	uintmax_t end;
+};
+
+// Data extents of a file (SEEK_DATA / SEEK_HOLE, FSCTL_QUERY_ALLOCATED_RANGES on Windows).
+// Holes shorter than the given size are counted as data. Unset when the file system
+// cannot tell or the file has no hole that long; an empty list means the whole file is
+// one hole.
+__declspec(dllexport) std::optional<std::vector<DataExtent>> data_extents(const Path&, uintmax_t) noexcept;
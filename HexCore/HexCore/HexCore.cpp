@@ -5,17 +5,105 @@
 #include <future>
 #include <unordered_map>
 #include <iostream>
+#include <cstring>
+#include <utility>
+#include <numeric>
+#include <mutex>
+#include <map>
 #include "HexCore.h"
+#include "IoScheduler.h"
+#include "Trace.h"
 
 namespace fs = std::filesystem;
 
-std::size_t RawBytesHasher::operator()(const RawBytes& hex) const
+namespace
 {
-	std::size_t seed = hex.get().size();
-	for (int i = 0; i < hex.get().size(); ++i)
+	// Short patterns are compared as one or two (possibly overlapping) word loads
+	// instead of a byte loop; the word width is fixed by the pattern length at compile time.
+	template <std::size_t N>
+	using KernelWord = std::conditional_t<(N <= 3), uint16_t, std::conditional_t<(N <= 7), uint32_t, uint64_t>>;
+
+	template <class W>
+	inline W load_word(const char* p) noexcept
+	{
+		W w;
+		std::memcpy(&w, p, sizeof(W));
+		return w;
+	}
+
+	template <std::size_t N>
+	inline bool equal_fixed(const char* p, const char* pattern) noexcept
 	{
-		seed ^= hex.get().at(i) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+		if constexpr (N == 1)
+			return *p == *pattern;
+		else
+		{
+			using W = KernelWord<N>;
+			if constexpr (N == sizeof(W))
+				return load_word<W>(p) == load_word<W>(pattern);
+			else
+				return load_word<W>(p) == load_word<W>(pattern) && load_word<W>(p + N - sizeof(W)) == load_word<W>(pattern + N - sizeof(W));
+		}
+	}
+
+	template <std::size_t N>
+	const char* find_fixed(const char* first, const char* last, const char* pattern, std::size_t) noexcept
+	{
+		if (last - first < static_cast<std::ptrdiff_t>(N))
+			return nullptr;
+		const char* stop = last - N + 1;
+		while (first != stop)
+		{
+			first = static_cast<const char*>(std::memchr(first, *pattern, stop - first));
+			if (!first)
+				return nullptr;
+			if (equal_fixed<N>(first, pattern))
+				return first;
+			++first;
+		}
+		return nullptr;
+	}
+
+	const char* find_generic(const char* first, const char* last, const char* pattern, std::size_t size) noexcept
+	{
+		if (last - first < static_cast<std::ptrdiff_t>(size))
+			return nullptr;
+		const char* stop = last - size + 1;
+		while (first != stop)
+		{
+			first = static_cast<const char*>(std::memchr(first, *pattern, stop - first));
+			if (!first)
+				return nullptr;
+			if (std::memcmp(first, pattern, size) == 0)
+				return first;
+			++first;
+		}
+		return nullptr;
 	}
+
+	constexpr std::size_t max_fixed_kernel = 16;
+
+	// Upper bound of concurrently read files on one device; fast devices need more
+	// outstanding reads than there are cores.
+	const unsigned max_io_threads = std::min(4 * std::max(std::thread::hardware_concurrency(), 1u), 64u);
+
+	template <std::size_t... I>
+	constexpr std::array<MatchKernel, sizeof...(I)> make_kernels(std::index_sequence<I...>) noexcept
+	{
+		return { &find_fixed<I + 1>... };
+	}
+
+	constexpr auto fixed_kernels = make_kernels(std::make_index_sequence<max_fixed_kernel>{});
+
+	constexpr size_t no_entry = static_cast<size_t>(-1);
+
+}
+
+std::size_t RawBytesHasher::operator()(const RawBytes& hex) const
+{
+	std::size_t seed = hex.get().size();
+	for (char ch : hex.get())
+		seed ^= ch + 0x9e3779b9 + (seed << 6) + (seed >> 2);
 	return seed;
 }
 
@@ -45,14 +133,6 @@ bool RawBytes::operator<(const RawBytes& other) const noexcept
 {
 	return this->get() < other.get();
 }
-inline const std::vector<char>& RawBytes::get() const noexcept
-{
-	return this->seq;
-}
-inline size_t RawBytes::size() const noexcept
-{
-	return this->get().size();
-}
 RawBytes::RawBytes(std::string_view src) : seq(src.size())
 {
 	for (size_t i = 0; i < src.size(); ++i)
@@ -210,70 +290,517 @@ bool IfstreamSlicer::end() const
 }
 
 
-SearchRes::SearchRes(RawBytesSet h, std::unordered_map<Path, std::vector<PositionsInFile>> umap, UnopenedFiles skipped) {
+IfstreamWindow::IfstreamWindow(const Path& path, std::size_t window_size, std::size_t overlap, ReadMode mode, bool skip_holes) : overlap{ overlap }, total_size{ fs::file_size(fs::path{ path }) }
+{
+	if (!fs::is_regular_file(path))
+		throw std::logic_error("Invalid path");
+	if (window_size <= overlap)
+		throw std::logic_error("Window is smaller than overlap");
+	HEXCORE_TRACE_SPAN(span, TracePhase::Open, 1);
+
+	constexpr auto alignment = AlignedBuffer::alignment;
+	if (mode == ReadMode::Buffered)
+	{
+		this->file = std::ifstream{ fs::path{ path }, std::ios::binary };
+		if (!this->file)
+			throw std::runtime_error("Bad file access");
+	}
+	else
+	{
+		this->native.emplace(path, mode);
+	}
+	this->prefix = (overlap + alignment - 1) / alignment * alignment;
+	this->body = window_size - overlap;
+	if (this->native && this->native->direct())
+		this->body = (this->body + alignment - 1) / alignment * alignment;
+	this->buffer = AlignedBuffer{ this->prefix + this->body };
+	if (skip_holes && this->total_size >= window_size)
+		this->extents = data_extents(path, window_size);
+}
+bool IfstreamWindow::next()
+{
+	if (this->started)
+	{
+		if (this->window_offset + this->filled >= this->total_size)
+			return false;
+		auto keep = this->filled < this->overlap ? this->filled : this->overlap;
+		std::memmove(this->buffer.data() + this->prefix - keep, this->data() + this->filled - keep, keep);
+		this->window_offset += this->filled - keep;
+		this->filled = keep;
+	}
+	this->started = true;
+	bool skipped = this->extents && this->skip_hole();
+	this->start = this->prefix - this->filled;
+
+	HEXCORE_TRACE_SPAN(span, TracePhase::Read);
+	std::size_t read = 0;
+	if (this->native)
+	{
+		read = this->native->read_at(this->read_offset, this->buffer.data() + this->prefix, this->body);
+		// The bytes are copied out already; cached pages of a one-shot sweep are only
+		// in the way of other readers.
+		this->native->drop_cache(this->read_offset, read);
+	}
+	else
+	{
+		this->file.read(this->buffer.data() + this->prefix, this->body);
+		read = static_cast<std::size_t>(this->file.gcount());
+	}
+	this->read_offset += read;
+	this->filled += read;
+	HEXCORE_TRACE_ADD(span, 0, read);
+
+	return read != 0 || skipped;
+}
+const char* IfstreamWindow::data() const noexcept
+{
+	return this->buffer.data() + this->start;
+}
+std::size_t IfstreamWindow::size() const noexcept
+{
+	return this->filled;
+}
+uintmax_t IfstreamWindow::offset() const noexcept
+{
+	return this->window_offset;
+}
+uintmax_t IfstreamWindow::file_size() const noexcept
+{
+	return this->total_size;
+}
+bool IfstreamWindow::last() const noexcept
+{
+	return this->window_offset + this->filled >= this->total_size;
+}
+bool IfstreamWindow::skip_hole()
+{
+	const auto& extents = *this->extents;
+	while (this->extent != extents.size() && extents[this->extent].end <= this->read_offset)
+		++this->extent;
+	uintmax_t hole_begin = this->extent == 0 ? 0 : extents[this->extent - 1].end;
+	uintmax_t hole_end = this->extent == extents.size() ? this->total_size : extents[this->extent].begin;
+	if (this->read_offset >= hole_end)
+		return false;
+	// Matches that start in the data and end in the hole were found by the previous
+	// windows only once they read a full overlap of it.
+	if (this->read_offset != 0 && this->read_offset < hole_begin + this->overlap)
+		return false;
+	auto target = hole_end / AlignedBuffer::alignment * AlignedBuffer::alignment;
+	if (target < this->read_offset + this->overlap)
+		return false;
 
-	for (const auto& p : umap)
-		if (p.second.size() != h.size())
+	std::memset(this->buffer.data() + this->prefix - this->overlap, 0, this->overlap);
+	this->window_offset = target - this->overlap;
+	this->filled = this->overlap;
+	this->read_offset = target;
+	if (!this->native)
+	{
+		this->file.clear();
+		this->file.seekg(static_cast<std::streamoff>(target));
+	}
+	return true;
+}
+
+
+SearchRes::SearchRes(RawBytesList h, std::vector<Path> paths, std::vector<PositionsInFile> positions, UnopenedFiles skipped) {
+
+	if (positions.size() != paths.size() * h.size())
+		throw std::logic_error("Wrong data");
+	this->sizes.resize(paths.size(), 0);
+
+	this->files_index.reserve(paths.size());
+	for (FileId i = 0; i != paths.size(); ++i)
+		if (!this->files_index.emplace(paths[i], i).second)
 			throw std::logic_error("Wrong data");
 
 	this->tofind = std::move(h);
-	this->data = umap;
-	this->skipped = skipped;
+	this->files = std::move(paths);
+	this->ranges.reserve(this->files.size());
+	for (FileId i = 0; i != this->files.size(); ++i)
+	{
+		auto first = this->found.size();
+		for (PatternId pattern = 0; pattern != this->tofind.size(); ++pattern)
+		{
+			const auto& e = positions[i * this->tofind.size() + pattern];
+			if (e.empty())
+				continue;
+			this->found.push_back(pattern);
+			this->firsts.push_back(this->data.size());
+			this->data.insert(this->data.end(), e.cbegin(), e.cend());
+		}
+		this->ranges.emplace_back(first, this->found.size());
+	}
+	this->skipped = std::move(skipped);
 }
-SearchRes::SearchRes(RawBytesSet h, UnopenedFiles skipped) {
+SearchRes::SearchRes(RawBytesList h, UnopenedFiles skipped) {
 
 	if(!skipped)
 		throw std::logic_error("Wrong data");
 
 	this->tofind = std::move(h);
-	this->skipped = skipped;
+	this->skipped = std::move(skipped);
 }
-bool SearchRes::contains(const Path& p) const
+SearchRes::SearchRes(RawBytesList h, size_t context_size, unsigned max_mismatches) : tofind{ std::move(h) }, context_bytes{ context_size }, mismatch_limit{ max_mismatches }, skipped{ std::vector<Path>{} }
 {
-	return this->data.contains(p);
 }
-RawBytesSet::const_iterator SearchRes::rowbytes_cbegin() const
+SearchRes::SearchRes(std::shared_ptr<const PatternSet> patterns, size_t context_size, unsigned max_mismatches) : set{ std::move(patterns) }, context_bytes{ context_size }, mismatch_limit{ max_mismatches }, skipped{ std::vector<Path>{} }
 {
-	return this->tofind.cbegin();
+	if (!this->set)
+		throw std::logic_error("Wrong data");
+}
+bool SearchRes::contains(const Path& p) const
+{
+	return this->files_index.contains(p);
 }
 inline bool SearchRes::empty() const noexcept
 {
-	return this->data.empty();
+	return this->files.empty();
+}
+size_t SearchRes::patterns_count() const noexcept
+{
+	return this->set ? this->set->size() : this->tofind.size();
+}
+size_t SearchRes::files_count() const noexcept
+{
+	return this->files.size();
+}
+std::string_view SearchRes::pattern(PatternId id) const
+{
+	if (id >= this->patterns_count())
+		throw std::out_of_range("No such sequence found");
+	if (this->set)
+		return this->set->pattern(id);
+	const auto& bytes = this->tofind[id].get();
+	return { bytes.data(), bytes.size() };
+}
+const Path& SearchRes::path(FileId id) const
+{
+	return this->files.at(id);
+}
+std::optional<FileId> SearchRes::find_file(const Path& p) const noexcept
+{
+	auto it = this->files_index.find(p);
+	if (it == this->files_index.cend())
+		return {};
+	return it->second;
+}
+std::optional<PatternId> SearchRes::find_pattern(const RawBytes& h) const noexcept
+{
+	std::string_view bytes{ h.get().data(), h.size() };
+	for (PatternId i = 0; i != this->patterns_count(); ++i)
+		if (this->pattern(i) == bytes)
+			return i;
+	return {};
+}
+uintmax_t SearchRes::file_size(FileId id) const
+{
+	return this->sizes.at(id);
+}
+size_t SearchRes::context_size() const noexcept
+{
+	return this->context_bytes;
+}
+MatchContext SearchRes::context(FileId file, PatternId pattern, size_t hit) const
+{
+	auto ref = this->hits_of(this->slot(file, pattern));
+	if (this->context_bytes == 0 || hit >= ref.positions.size())
+		throw std::out_of_range("No context for this hit");
+
+	return this->make_context(file, pattern, ref.positions[hit], ref.contexts.data() + hit * 2 * this->context_bytes);
+}
+unsigned SearchRes::max_mismatches() const noexcept
+{
+	return this->mismatch_limit;
+}
+unsigned SearchRes::distance(FileId file, PatternId pattern, size_t hit) const
+{
+	auto ref = this->hits_of(this->slot(file, pattern));
+	if (hit >= ref.positions.size())
+		throw std::out_of_range("No such hit");
+	if (this->mismatch_limit == 0)
+		return 0;
+
+	return ref.distances[hit];
+}
+size_t SearchRes::hits(FileId file, PatternId pattern) const
+{
+	auto i = this->slot(file, pattern);
+	if (!i)
+		return 0;
+	auto [first, last] = this->entry_hits(*i);
+	auto it = this->spilled.find(*i);
+	return last - first + (it != this->spilled.cend() ? it->second.count : 0);
+}
+bool SearchRes::truncated(FileId file, PatternId pattern) const
+{
+	auto i = this->slot(file, pattern);
+	return i && this->truncation.contains(*i);
+}
+std::span<const PatternId> SearchRes::patterns_found(FileId file) const
+{
+	if (file >= this->files.size())
+		throw std::out_of_range("No such path found");
+
+	auto [first, last] = this->ranges[file];
+	return { this->found.data() + first, last - first };
+}
+void SearchRes::for_each_hit(FileId file, PatternId pattern, size_t first, size_t last, const HitCallback& on_hit) const
+{
+	auto slot = this->slot(file, pattern);
+	if (first > last || last > this->hits(file, pattern))
+		throw std::out_of_range("No such hit");
+	if (!slot)
+		return;
+	auto i = *slot;
+
+	auto n = this->context_bytes;
+	auto emit = [this, file, pattern, n, &on_hit](const uintmax_t* positions, const uint8_t* distances, const char* contexts, size_t from, size_t to) {
+		for (auto hit = from; hit != to; ++hit)
+		{
+			MatchHit match{ positions[hit], this->mismatch_limit != 0 ? distances[hit] : 0u, {} };
+			if (n != 0)
+				match.context = this->make_context(file, pattern, positions[hit], contexts + hit * 2 * n);
+			on_hit(match);
+		}
+	};
+
+	// Spilled runs hold the earliest hits; they are read back a chunk at a time.
+	constexpr size_t chunk = 1 << 16;
+	size_t index = 0;
+	if (auto it = this->spilled.find(i); it != this->spilled.cend())
+	{
+		PositionsInFile positions{};
+		DistancesInFile distances{};
+		ContextInFile contexts{};
+		for (const auto& run : it->second.runs)
+		{
+			auto from = std::max(first, index), to = std::min<size_t>(last, index + run.count);
+			for (auto at = from; at < to; at += chunk)
+			{
+				auto count = std::min(chunk, to - at);
+				positions.clear();
+				distances.clear();
+				contexts.clear();
+				it->second.store->read(run, at - index, count, positions, distances, contexts);
+				emit(positions.data(), distances.data(), contexts.data(), 0, count);
+			}
+			index += run.count;
+		}
+	}
+	if (last > index)
+	{
+		auto start = this->entry_hits(i).first;
+		auto distances = this->mismatch_limit != 0 ? this->distances.data() + start : nullptr;
+		auto contexts = n != 0 ? this->contexts.data() + start * 2 * n : nullptr;
+		emit(this->data.data() + start, distances, contexts, std::max(first, index) - index, last - index);
+	}
 }
-RawBytesSet::const_iterator SearchRes::rowbytes_cend() const
+HitPositions SearchRes::at(FileId file, PatternId pattern) const
 {
-	return this->tofind.cend();
+	return this->hits_of(this->slot(file, pattern)).positions;
 }
-const PositionsInFile& SearchRes::at(const Path& p, const RawBytes& h) const
+HitPositions SearchRes::at(const Path& p, PatternId pattern) const
 {
-	auto p_it = this->data.find(p);
-	if (p_it == this->data.cend())
+	auto file = this->find_file(p);
+	if (!file)
 		throw std::out_of_range("No such path found");
-	auto h_it = this->tofind.find(h);
-	if (h_it == this->tofind.cend())
+
+	return this->at(*file, pattern);
+}
+HitPositions SearchRes::at(const Path& p, const RawBytes& h) const
+{
+	auto file = this->find_file(p);
+	if (!file)
+		throw std::out_of_range("No such path found");
+	auto pattern = this->find_pattern(h);
+	if (!pattern)
 		throw std::logic_error("No such sequence found");
 
-	return p_it->second.at(std::distance(this->tofind.cbegin(), h_it));
+	return this->at(*file, *pattern);
 }
 std::vector<Path> SearchRes::collect_paths() const noexcept
 {
-	std::vector<Path> paths;
-	paths.reserve(this->data.size());
-	for (const auto& e : this->data)
-		paths.push_back(e.first);
-
-	return paths;
+	return this->files;
 }
 const UnopenedFiles& SearchRes::unopened_files() const noexcept
 {
 	return this->skipped;
 }
+FileId SearchRes::add_file(Path p, FileMatches matches)
+{
+	auto entries = matches.patterns.size();
+	auto total = matches.positions.size();
+	if (matches.firsts.size() != entries || (entries != 0 && matches.firsts.front() != 0))
+		throw std::logic_error("Wrong data");
+	for (size_t i = 0; i != entries; ++i)
+	{
+		if (matches.patterns[i] >= this->patterns_count() || (i != 0 && matches.patterns[i] <= matches.patterns[i - 1]))
+			throw std::logic_error("Wrong data");
+		if (matches.firsts[i] > total || (i != 0 && matches.firsts[i] < matches.firsts[i - 1]))
+			throw std::logic_error("Wrong data");
+	}
+	if (entries == 0 && total != 0)
+		throw std::logic_error("Wrong data");
+	if (this->context_bytes != 0 && matches.contexts.size() != total * 2 * this->context_bytes)
+		throw std::logic_error("Wrong data");
+	if (this->mismatch_limit != 0 && matches.distances.size() != total)
+		throw std::logic_error("Wrong data");
+	if (!matches.spilled.empty() && (matches.spilled.size() != entries || !matches.store))
+		throw std::logic_error("Wrong data");
+	if (!matches.truncated.empty() && matches.truncated.size() != entries)
+		throw std::logic_error("Wrong data");
+
+	FileId id = this->files.size();
+	if (!this->files_index.emplace(p, id).second)
+		throw std::logic_error("Path is already added");
+	auto first = this->found.size();
+	this->files.push_back(std::move(p));
+	this->sizes.push_back(matches.file_size);
+	for (size_t i = 0; i != entries; ++i)
+	{
+		auto from = matches.firsts[i], to = i + 1 != entries ? matches.firsts[i + 1] : total;
+		// An entry that ended up with nothing in it takes no slot.
+		bool spill = !matches.spilled.empty() && !matches.spilled[i].empty();
+		bool truncated = !matches.truncated.empty() && matches.truncated[i];
+		if (from == to && !spill && !truncated)
+			continue;
+
+		auto slot = this->found.size();
+		this->found.push_back(matches.patterns[i]);
+		this->firsts.push_back(this->data.size() + from);
+		if (spill)
+		{
+			size_t count = 0;
+			for (const auto& run : matches.spilled[i])
+				count += static_cast<size_t>(run.count);
+			this->spilled.emplace(slot, SpilledHits{ matches.store, std::move(matches.spilled[i]), count });
+		}
+		if (truncated)
+			this->truncation.insert(slot);
+	}
+	this->data.insert(this->data.end(), matches.positions.cbegin(), matches.positions.cend());
+	if (this->context_bytes != 0)
+		this->contexts.insert(this->contexts.end(), matches.contexts.cbegin(), matches.contexts.cend());
+	if (this->mismatch_limit != 0)
+		this->distances.insert(this->distances.end(), matches.distances.cbegin(), matches.distances.cend());
+	this->ranges.emplace_back(first, this->found.size());
+
+	return id;
+}
+FileId SearchRes::add_alias(Path p, FileId origin)
+{
+	if (origin >= this->files.size())
+		throw std::out_of_range("No such path found");
+
+	FileId id = this->files.size();
+	if (!this->files_index.emplace(p, id).second)
+		throw std::logic_error("Path is already added");
+	this->files.push_back(std::move(p));
+	this->ranges.push_back(this->ranges[origin]);
+	this->sizes.push_back(this->sizes[origin]);
+
+	return id;
+}
+void SearchRes::add_unopened(Path p)
+{
+	if (!this->skipped)
+		this->skipped.emplace();
+	this->skipped->push_back(std::move(p));
+}
 void SearchRes::reset() noexcept
 {
+	this->found.clear();
+	this->firsts.clear();
 	this->data.clear();
+	this->ranges.clear();
+	this->sizes.clear();
+	this->contexts.clear();
+	this->context_bytes = 0;
+	this->mismatch_limit = 0;
+	this->distances.clear();
+	this->files.clear();
+	this->files_index.clear();
 	this->tofind.clear();
+	this->set.reset();
 	if(this->skipped)
 		this->skipped->clear();
+	this->spilled.clear();
+	this->truncation.clear();
+	this->loaded = std::make_shared<LoadCache>();
+}
+std::optional<size_t> SearchRes::slot(FileId file, PatternId pattern) const
+{
+	if (file >= this->files.size())
+		throw std::out_of_range("No such path found");
+	if (pattern >= this->patterns_count())
+		throw std::logic_error("No such sequence found");
+
+	auto [first, last] = this->ranges[file];
+	auto it = std::lower_bound(this->found.cbegin() + first, this->found.cbegin() + last, pattern);
+	if (it == this->found.cbegin() + last || *it != pattern)
+		return {};
+	return static_cast<size_t>(it - this->found.cbegin());
+}
+std::pair<size_t, size_t> SearchRes::entry_hits(size_t i) const noexcept
+{
+	return { this->firsts[i], i + 1 != this->firsts.size() ? this->firsts[i + 1] : this->data.size() };
+}
+SearchRes::HitsRef SearchRes::hits_of(std::optional<size_t> slot) const
+{
+	if (!slot)
+		return {};
+	auto i = *slot;
+	auto [first, last] = this->entry_hits(i);
+	HitsRef memory{ { this->data.data() + first, last - first } };
+	if (this->context_bytes != 0)
+		memory.contexts = { this->contexts.data() + first * 2 * this->context_bytes, (last - first) * 2 * this->context_bytes };
+	if (this->mismatch_limit != 0)
+		memory.distances = { this->distances.data() + first, last - first };
+	auto it = this->spilled.find(i);
+	if (it == this->spilled.cend())
+		return memory;
+
+	auto& cache = *this->loaded;
+	std::lock_guard<std::mutex> lock{ cache.mutex };
+	if (auto entry = cache.pairs.find(i); entry != cache.pairs.end())
+	{
+		cache.order.splice(cache.order.begin(), cache.order, entry->second.second);
+		const auto& hits = entry->second.first;
+		return { hits.positions, hits.contexts, hits.distances };
+	}
+
+	LoadedHits hits{};
+	for (const auto& run : it->second.runs)
+		it->second.store->read(run, 0, static_cast<size_t>(run.count), hits.positions, hits.distances, hits.contexts);
+	hits.positions.insert(hits.positions.end(), memory.positions.begin(), memory.positions.end());
+	hits.contexts.insert(hits.contexts.end(), memory.contexts.begin(), memory.contexts.end());
+	hits.distances.insert(hits.distances.end(), memory.distances.begin(), memory.distances.end());
+
+	// The pair asked for is always kept, even when it alone is over the limit.
+	auto size = hits.positions.size() * sizeof(uintmax_t) + hits.contexts.size() + hits.distances.size();
+	while (!cache.order.empty() && cache.bytes + size > max_loaded)
+	{
+		auto victim = cache.pairs.find(cache.order.back());
+		const auto& old = victim->second.first;
+		cache.bytes -= old.positions.size() * sizeof(uintmax_t) + old.contexts.size() + old.distances.size();
+		cache.pairs.erase(victim);
+		cache.order.pop_back();
+	}
+	cache.order.push_front(i);
+	cache.bytes += size;
+	auto& entry = cache.pairs.emplace(i, std::make_pair(std::move(hits), cache.order.begin())).first->second.first;
+
+	return { entry.positions, entry.contexts, entry.distances };
+}
+MatchContext SearchRes::make_context(FileId file, PatternId pattern, uintmax_t pos, const char* base) const noexcept
+{
+	auto n = this->context_bytes;
+	auto end = pos + (this->set ? this->set->pattern(pattern).size() : this->tofind[pattern].size());
+	auto size = this->sizes[file];
+	size_t before = pos < n ? static_cast<size_t>(pos) : n;
+	size_t after = (size == 0 || end + n <= size) ? n : static_cast<size_t>(size - end);
+
+	return { std::string_view{ base + n - before, before }, std::string_view{ base + n, after } };
 }
 
 Search::Search(Path path, RawBytesSet tofind)
@@ -289,35 +816,61 @@ Search::Search(Path path, RawBytesSet tofind)
 			if (!fs::is_directory(status(p)) && fs::is_regular_file(status(p)))
 				this->paths.push_back(fs::path(p).wstring());
 	}
+	for (auto& hex : tofind)
+		this->add_bytes(hex);
 }
-bool Search::add_bytes(RawBytes hex) noexcept
+std::optional<PatternId> Search::add_bytes(RawBytes hex) noexcept
 {
-	if (hex.get().empty()) return false;
+	if (hex.get().empty() || this->compiled) return {};
 	try
 	{
-		this->tofind.insert(hex);
+		auto it = this->tofind_index.find(hex);
+		if (it != this->tofind_index.cend())
+			return it->second;
+
+		PatternId id = this->tofind.size();
+		this->tofind.push_back(hex);
+		this->tofind_index.emplace(std::move(hex), id);
+		return id;
 	}
 	catch (...)
 	{
 		std::cerr << "Unexpected error";
-		return false;
 	}
 
-	return true;
+	return {};
 }
 bool Search::add_path(Path path) noexcept
 {
+	HEXCORE_TRACE_SPAN(span, TracePhase::Enumerate);
 	try
 	{
 		if (fs::is_directory(path))
 		{
-			for (auto& p : fs::recursive_directory_iterator(path))
-				if (!fs::is_directory(status(p)) && fs::is_regular_file(status(p)))
-					this->paths.push_back(fs::path(p).wstring());
+			std::optional<uint64_t> device{};
+			if (this->filter.same_filesystem())
+				if (auto id = identify_file(path))
+					device = id->device;
+
+			// Rejected directories are pruned before the iterator enters them.
+			for (auto it = fs::recursive_directory_iterator(path); it != fs::recursive_directory_iterator{}; ++it)
+			{
+				if (it->is_directory())
+				{
+					if (!this->filter.accepts_directory(*it, device))
+						it.disable_recursion_pending();
+				}
+				else if (it->is_regular_file() && this->filter.accepts_file(*it))
+				{
+					this->paths.push_back(it->path().wstring());
+					HEXCORE_TRACE_ADD(span, 1, 0);
+				}
+			}
 		}
-		else if (fs::is_regular_file(path))
+		else if (fs::is_regular_file(path) && this->filter.accepts_file(fs::directory_entry{ path }))
 		{
 			this->paths.push_back(path);
+			HEXCORE_TRACE_ADD(span, 1, 0);
 		}
 	}
 	catch (const std::exception& e)
@@ -333,161 +886,615 @@ bool Search::add_path(Path path) noexcept
 
 	return true;
 }
+void Search::set_context_size(size_t n) noexcept
+{
+	this->context_size = n;
+}
+void Search::set_dedup(Dedup mode) noexcept
+{
+	this->dedup = mode;
+}
+void Search::set_filter(PathFilter f) noexcept
+{
+	this->filter = std::move(f);
+}
+void Search::set_read_mode(ReadMode mode) noexcept
+{
+	this->read_mode = mode;
+}
+void Search::set_max_mismatches(unsigned k) noexcept
+{
+	this->mismatch_limit = std::min(k, 255u);
+}
+void Search::set_pattern_set(std::shared_ptr<const PatternSet> set) noexcept
+{
+	this->tofind.clear();
+	this->tofind_index.clear();
+	this->compiled = std::move(set);
+}
+const std::shared_ptr<const PatternSet>& Search::pattern_set() const noexcept
+{
+	return this->compiled;
+}
+void Search::set_memory_budget(size_t bytes, BudgetPolicy policy, Path directory) noexcept
+{
+	this->memory_budget = bytes;
+	this->budget_policy = policy;
+	this->spill_directory = std::move(directory);
+}
 void Search::reset() noexcept
 {
 	this->paths.clear();
 	this->tofind.clear();
-	this->threads_number = std::thread::hardware_concurrency() - 1;
+	this->tofind_index.clear();
+	this->threads_number = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	this->context_size = 0;
+	this->dedup = Dedup::None;
+	this->filter = PathFilter{};
+	this->read_mode = ReadMode::Buffered;
+	this->mismatch_limit = 0;
+	this->matchers.clear();
+	this->compiled.reset();
+	this->skip_holes = false;
+	this->memory_budget = 0;
+	this->budget_policy = BudgetPolicy::Spill;
+	this->spill_directory.clear();
+	this->budget.reset();
 }
 size_t Search::size() const noexcept
 {
 	return this->paths.size();
 }
+const RawBytesList& Search::patterns() const noexcept
+{
+	return this->tofind;
+}
 bool Search::ready() const noexcept
 {
-	return !this->paths.empty() && !this->tofind.empty();
+	return !this->paths.empty() && (this->compiled ? !this->compiled->empty() : !this->tofind.empty());
 }
-SearchRes Search::exec_and_reset(size_t slice_size, std::atomic<unsigned>& progress)
+SearchRes Search::exec_and_reset(size_t slice_size, SearchProgress& progress, FileResultCallback on_file)
 {
 	if (!this->ready()) return {};
 
-	auto check = this->tofind.cbegin()->get();
-
-	std::vector<std::vector<unsigned>> paths_indexes = this->group_paths_for_threads();
-	std::vector<Path> unopened_files{};
-	std::unordered_map<Path, std::vector<PositionsInFile>> data{};
-	if (this->paths.size() == 1)
-	{
-		try
+	this->sort_paths();
+	auto plan = this->dedup_paths();
+	this->matchers.clear();
+	if (this->mismatch_limit != 0)
+		for (PatternId i = 0; i != this->patterns_count(); ++i)
 		{
-			auto data = this->search_bytes_in_file(this->tofind, this->paths.at(0), slice_size, progress);
-			std::unordered_map<Path, std::vector<PositionsInFile>> umap{ {std::move(this->paths.at(0)), this->search_bytes_in_file(this->tofind, this->paths.at(0), slice_size, progress)} };
-			auto res = SearchRes{ std::move(this->tofind), std::move(umap), {} };
-			this->reset();
-			return res;
+			auto bytes = this->pattern_bytes(i);
+			this->matchers.emplace_back(std::vector<char>(bytes.cbegin(), bytes.cend()), this->mismatch_limit);
 		}
-		catch (const std::exception& e)
-		{
-			std::cerr << e.what();
-			unopened_files.push_back(std::move(this->paths.at(0)));
-		}
-
-		return SearchRes(std::move(this->tofind), std::move(unopened_files));
+	// Holes of sparse files read as zeros and are skipped unless some pattern matches a
+	// run of zeros, that is has no more non-zero bytes than mismatches allowed.
+	this->skip_holes = true;
+	for (PatternId i = 0; i != this->patterns_count() && this->skip_holes; ++i)
+	{
+		auto bytes = this->pattern_bytes(i);
+		auto nonzero = std::count_if(bytes.cbegin(), bytes.cend(), [](char ch) { return ch != 0; });
+		this->skip_holes = static_cast<size_t>(nonzero) > this->mismatch_limit;
+	}
+	this->budget.reset();
+	if (this->memory_budget != 0)
+	{
+		auto store = std::make_shared<SpillStore>(this->spill_directory, this->context_size, this->mismatch_limit != 0);
+		this->budget = std::make_unique<ResultBudget>(this->memory_budget, this->budget_policy, std::move(store));
 	}
 
-	std::vector<std::future<std::pair<std::vector<std::pair<unsigned, std::vector<PositionsInFile>>>, UnopenedFiles>>> futures{};
-	futures.reserve(threads_number);
+	// Results of files that have aliases. An alias that is confirmed shares the result
+	// of its origin instead of copying it; SearchRes keeps it once for all of them.
+	struct Origin
+	{
+		std::shared_ptr<FileMatches> matches;
+		size_t pending;
+	};
+	std::mutex origins_mutex{};
+	std::unordered_map<unsigned, Origin> origins{};
+	std::unordered_map<unsigned, size_t> alias_counts{};
+	for (const auto& alias : plan.aliases)
+		++alias_counts[alias.second.origin];
 
-	auto func = [this, slice_size, &progress](const std::vector<unsigned>& indexes) {
-		std::pair<std::vector<std::pair<unsigned, std::vector<PositionsInFile>>>, UnopenedFiles> result{};
-		result.first.reserve(indexes.size());
-		for (auto i : indexes)
+	using ThreadResult = std::pair<std::vector<std::pair<unsigned, std::shared_ptr<FileMatches>>>, std::vector<Path>>;
+	auto scan = [this, &progress, &plan, &origins, &origins_mutex, &alias_counts](unsigned i, size_t slice, std::atomic<uintmax_t>* transferred) {
+		auto matches = std::make_shared<FileMatches>(this->search_bytes_in_file(this->paths.at(i), slice, progress, transferred));
+		if (plan.origin[i] && !progress.cancelled)
 		{
-			const auto& path = this->paths.at(i);
-			try
+			std::lock_guard<std::mutex> lock{ origins_mutex };
+			origins.emplace(i, Origin{ matches, alias_counts[i] });
+		}
+		return matches;
+	};
+	// With a per-file callback the origin has already been handed out, so it is kept only
+	// until its last alias is resolved.
+	auto resolve = [this, &progress, &plan, &origins, &origins_mutex, &scan, &on_file](unsigned i, size_t slice, std::atomic<uintmax_t>* transferred) {
+		const auto& alias = plan.aliases.at(i);
+		std::shared_ptr<FileMatches> matches{};
+		{
+			std::lock_guard<std::mutex> lock{ origins_mutex };
+			if (auto it = origins.find(alias.origin); it != origins.end())
 			{
-				result.first.emplace_back(i, this->search_bytes_in_file(this->tofind, path, slice_size, progress));
+				matches = it->second.matches;
+				if (--it->second.pending == 0 && on_file)
+					it->second.matches.reset();
 			}
-			catch (const std::exception& e)
+		}
+		if (matches && (alias.same_inode || this->same_content(this->paths.at(alias.origin), this->paths.at(i), slice)))
+		{
+			progress.bytes += matches->file_size;
+			++progress.files;
+			return matches;
+		}
+		return scan(i, slice, transferred);
+	};
+	// Files are pulled from an IoScheduler, which decides per device how many of them are
+	// read at once and how large the read windows are.
+	auto run = [this, slice_size, &progress, &on_file](const std::vector<unsigned>& indexes, auto process) {
+		{
+			HEXCORE_TRACE_SPAN(span, TracePhase::Stat, indexes.size());
+			for (auto i : indexes)
 			{
-				std::cerr << e.what();
-				result.second->push_back(path);
+				std::error_code ec{};
+				auto size = fs::file_size(this->paths.at(i), ec);
+				progress.total_bytes += ec ? 0 : size;
+				HEXCORE_TRACE_ADD(span, 0, ec ? 0 : size);
 			}
 		}
+		IoScheduler scheduler{ this->paths, indexes, this->threads_number, max_io_threads };
+		auto func = [this, slice_size, &progress, &on_file, &process, &scheduler]() {
+			ThreadResult result{};
+			while (auto task = scheduler.next())
+			{
+				if (progress.cancelled)
+				{
+					scheduler.done(*task);
+					scheduler.cancel();
+					break;
+				}
+				const auto& path = this->paths.at(task->index);
+				try
+				{
+					auto matches = process(task->index, slice_size * task->read_ahead, task->transferred);
+					scheduler.done(*task);
+					if (progress.cancelled)
+						continue;
+					// The callback takes its own copy of a result that is shared with aliases.
+					if (on_file)
+						on_file(path, matches.use_count() == 1 ? std::move(*matches) : FileMatches{ *matches });
+					else
+						result.first.emplace_back(task->index, std::move(matches));
+				}
+				catch (const std::exception& e)
+				{
+					scheduler.done(*task);
+					std::cerr << e.what();
+					result.second.push_back(path);
+				}
+			}
 
-		return result;
+			return result;
+		};
+
+		std::vector<std::future<ThreadResult>> futures{};
+		futures.reserve(scheduler.workers());
+		for (unsigned i = 0; i != scheduler.workers(); ++i)
+			futures.push_back(std::async(std::launch::async, func));
+
+		std::vector<ThreadResult> results{};
+		results.reserve(futures.size());
+		for (auto& future : futures)
+			results.push_back(future.get());
+		return results;
 	};
 
-	for (const auto& indexes : paths_indexes)
-		futures.push_back(std::move(std::async(std::launch::async, func, indexes)));
-	
-	for (auto future_it = futures.begin(); future_it != futures.end(); ++future_it)
+	auto results = run(plan.scan, scan);
+	std::vector<unsigned> aliases{};
+	aliases.reserve(plan.aliases.size());
+	for (const auto& alias : plan.aliases)
+		aliases.push_back(alias.first);
+	for (auto& result : run(aliases, resolve))
+		results.push_back(std::move(result));
+
+	HEXCORE_TRACE_SPAN(merge, TracePhase::Merge);
+	std::vector<Path> unopened_files{};
+	std::vector<std::pair<unsigned, std::shared_ptr<FileMatches>>> found{};
+	found.reserve(this->paths.size());
+	for (auto& result : results)
 	{
-		auto tmp = future_it->get();
-		if (tmp.second)
-		{
-			for (auto& unopened_file : tmp.second.value())
-				unopened_files.push_back(std::move(unopened_file));
-		}
-		for (auto& result_for_file : tmp.first)
-			data.emplace(this->paths.at(result_for_file.first), std::move(result_for_file.second));
+		for (auto& unopened_file : result.second)
+			unopened_files.push_back(std::move(unopened_file));
+		for (auto& result_for_file : result.first)
+			found.push_back(std::move(result_for_file));
 	}
+	std::sort(found.begin(), found.end(), [](const auto& l, const auto& r) { return l.first < r.first; });
+	HEXCORE_TRACE_ADD(merge, found.size(), 0);
 
-	return unopened_files.size() == paths.size() ? SearchRes{std::move(this->tofind), std::move(unopened_files)} : SearchRes{ std::move(this->tofind), std::move(data), std::move(unopened_files) };
+	auto res = this->compiled ? SearchRes{ this->compiled, this->context_size, this->mismatch_limit } : SearchRes{ std::move(this->tofind), this->context_size, this->mismatch_limit };
+	// The first file of a group of aliases takes the shared result, the others refer to it.
+	std::unordered_map<const FileMatches*, FileId> added{};
+	for (auto& [index, matches] : found)
+	{
+		auto& path = this->paths.at(index);
+		if (auto it = added.find(matches.get()); it != added.cend())
+			res.add_alias(std::move(path), it->second);
+		else
+			added.emplace(matches.get(), res.add_file(std::move(path), std::move(*matches)));
+	}
+	for (auto& unopened_file : unopened_files)
+		res.add_unopened(std::move(unopened_file));
+
+	this->reset();
+	return res;
 }
-std::vector<PositionsInFile> Search::search_bytes_in_file(const RawBytesSet& hexes, const Path& path, size_t slice_size, std::atomic<unsigned>& progress)
+FileMatches Search::search_bytes_in_file(const Path& path, size_t slice_size, SearchProgress& progress, std::atomic<uintmax_t>* transferred) const
 {
 	if (!fs::exists(path) || !fs::is_regular_file(path)) 
 		throw std::logic_error("Invalid path");
-	std::vector<PositionsInFile> result(hexes.size());
-	if (hexes.empty()) 
+	auto count = this->patterns_count();
+	FileMatches result{};
+	bool approximate = this->mismatch_limit != 0;
+	if (count == 0) 
 		return result;
+	auto budget = this->budget.get();
+	if (budget)
+		result.store = budget->store();
+	// A pattern gets its entry when it is first found, so a large set costs nothing for
+	// the patterns a file does not contain.
+	ScanMatches found{};
+	std::vector<size_t> entries(count, no_entry);
+	auto entry = [this, &found, &entries, approximate, budget](PatternId i) {
+		auto& e = entries[i];
+		if (e == no_entry)
+		{
+			e = found.patterns.size();
+			found.patterns.push_back(i);
+			found.positions.emplace_back();
+			if (this->context_size != 0)
+				found.contexts.emplace_back();
+			if (approximate)
+				found.distances.emplace_back();
+			if (budget)
+			{
+				found.spilled.emplace_back();
+				found.truncated.push_back(false);
+			}
+		}
+		return e;
+	};
+
+	// A compiled set is matched in one pass over each window; patterns added one by one
+	// are searched for separately, each with its own kernel.
+	bool one_pass = this->compiled && !approximate;
+	std::vector<MatchKernel> kernels{};
+	size_t hex_max_size = 0;
+	if (this->compiled)
+		hex_max_size = this->compiled->max_size();
+	if (!one_pass)
+	{
+		kernels.reserve(count);
+		for (PatternId i = 0; i != count; ++i)
+		{
+			auto size = this->pattern_bytes(i).size();
+			kernels.push_back(select_kernel(size));
+			hex_max_size = std::max(hex_max_size, size);
+		}
+	}
 
-	auto hex_max_size = std::max_element(hexes.cbegin(), hexes.cend())->get().size();
-	slice_size = (hex_max_size > slice_size) ? hex_max_size : slice_size;
-	IfstreamSlicer file{ path, slice_size };
+	// The overlap kept between windows also holds the context of a match found at the
+	// very end of the previous window, so no hit has to look outside the current buffer.
+	auto ctx = this->context_size;
+	auto overlap = hex_max_size - 1 + 2 * ctx;
+	// The first window holds no overlap yet, so its body alone has to fit the longest
+	// sequence together with the trailing context kept for the next window.
+	slice_size = std::max(slice_size, hex_max_size + ctx);
+	IfstreamWindow file{ path, slice_size + overlap, overlap, this->read_mode, this->skip_holes };
+	result.file_size = file.file_size();
 
-	std::vector<uintmax_t> min_next_occur_pos(hexes.size(), 0);
-	auto it_hex = hexes.cbegin();
-	for (auto pos = file.tellg(); pos != file.size(); pos = file.tellg())
+	// First position each sequence may start at: matches of one sequence never overlap,
+	// and the overlap kept between windows must not be scanned twice.
+	std::vector<uintmax_t> min_next_occur_pos(count, 0);
+	// Bytes of the hits found since the last report to the budget, and since the last spill.
+	auto hit_size = sizeof(uintmax_t) + (approximate ? 1 : 0) + 2 * ctx;
+	size_t pending = 0;
+	size_t unspilled = 0;
+	// In one-pass mode every match ending at or before scanned_end has already been seen.
+	uintmax_t scanned_end = 0;
+	uintmax_t reported = 0;
+	while (!progress.cancelled && file.next())
 	{
-		auto hex_index = std::distance(hexes.cbegin(), it_hex);
-		bool found = true;
-		auto buff_pos = pos;
-		for (char ch : it_hex->get())
+		const char* first = file.data();
+		const char* last = first + file.size();
+		// Until the end of file a match must leave room for its trailing context;
+		// the rest is scanned again in the next window.
+		const char* scan_last = file.last() ? last : first + (file.size() > ctx ? file.size() - ctx : 0);
+		HEXCORE_TRACE_SPAN(span, TracePhase::Scan, 0, static_cast<uint64_t>(scan_last - first));
+		auto record = [&](PatternId i, const char* it, size_t size, unsigned distance) {
+			auto e = entry(i);
+			if (budget && budget->policy() == BudgetPolicy::Truncate && !budget->fits(pending + hit_size))
+			{
+				found.truncated[e] = true;
+				return;
+			}
+			pending += hit_size;
+			auto& positions = found.positions[e];
+			positions.push_back(file.offset() + (it - first));
+			if (approximate)
+				found.distances[e].push_back(static_cast<uint8_t>(distance));
+			if (ctx != 0)
+			{
+				auto& context = found.contexts[e];
+				size_t before = positions.back() < ctx ? static_cast<size_t>(positions.back()) : ctx;
+				size_t after = std::min<size_t>(ctx, last - (it + size));
+				context.insert(context.end(), ctx - before, 0);
+				context.insert(context.end(), it - before, it);
+				context.insert(context.end(), it + size, it + size + after);
+				context.insert(context.end(), ctx - after, 0);
+			}
+		};
+
+		if (one_pass)
 		{
-			auto opt_ch = file.get();
-			if (!opt_ch || ((file.size() - pos) < it_hex->size()) || (pos < min_next_occur_pos.at(hex_index)) || (ch != opt_ch.value()))
+			// scanned_end only advances over bytes that were actually scanned; an empty
+			// window leaves it alone.
+			if (scan_last != first)
 			{
-				found = false;
-				break;
+				auto from = scanned_end > file.offset() + hex_max_size - 1 ? scanned_end - (hex_max_size - 1) - file.offset() : 0;
+				this->compiled->scan(first + std::min<uintmax_t>(from, scan_last - first), scan_last, [&](PatternId i, const char* it) {
+					auto size = this->compiled->pattern(i).size();
+					auto pos = file.offset() + (it - first);
+					if (pos + size <= scanned_end || pos < min_next_occur_pos[i])
+						return;
+					record(i, it, size, 0);
+					min_next_occur_pos[i] = pos + size;
+				});
+				scanned_end = std::max<uintmax_t>(scanned_end, file.offset() + (scan_last - first));
 			}
 		}
-		if (found)
+		else for (PatternId i = 0; i != count; ++i)
 		{
-			result.at(hex_index).push_back(pos);
-			min_next_occur_pos.at(hex_index) = pos + it_hex->size();
+			auto bytes = this->pattern_bytes(i);
+			auto size = bytes.size();
+			if (static_cast<size_t>(scan_last - first) < size)
+				continue;
+
+			auto& next_pos = min_next_occur_pos[i];
+			const char* it = first + (next_pos > file.offset() ? next_pos - file.offset() : 0);
+			uintmax_t after_last = next_pos;
+			unsigned distance = 0;
+			auto find = [&]() {
+				return approximate ? this->matchers[i].find(it, scan_last, distance) : kernels[i](it, scan_last, bytes.data(), size);
+			};
+			while (it < scan_last && (it = find()) != nullptr)
+			{
+				record(i, it, size, distance);
+				it += size;
+				after_last = file.offset() + (it - first);
+			}
+			auto scanned = file.offset() + (scan_last - first) - size + 1;
+			next_pos = scanned > after_last ? scanned : after_last;
 		}
-		++it_hex;
-		if (it_hex == hexes.cend())
+		if (budget)
 		{
-			it_hex = hexes.cbegin();
-			++buff_pos;
+			budget->add(pending);
+			unspilled += pending;
+			pending = 0;
+			if (budget->policy() == BudgetPolicy::Spill && budget->exceeded() && unspilled >= budget->batch())
+			{
+				this->spill(found);
+				unspilled = 0;
+			}
 		}
-		file.seekg_prev(buff_pos);
-		//file.seekg_prev(++pos);
+		progress.bytes += file.offset() + file.size() - reported;
+		if (transferred)
+			*transferred += file.offset() + file.size() - reported;
+		reported = file.offset() + file.size();
 	}
-	++progress;
+	// Hits of a finished file can no longer be moved, so while the budget is exceeded the
+	// file leaves everything it still holds in the store.
+	if (budget && budget->policy() == BudgetPolicy::Spill && budget->exceeded())
+		this->spill(found, true);
+	flatten(found, result);
+	++progress.files;
 
 	return result;
 }
+MatchKernel Search::select_kernel(std::size_t size) noexcept
+{
+	return (size != 0 && size <= max_fixed_kernel) ? fixed_kernels[size - 1] : &find_generic;
+}
+size_t Search::patterns_count() const noexcept
+{
+	return this->compiled ? this->compiled->size() : this->tofind.size();
+}
+void Search::spill(ScanMatches& matches, bool all) const
+{
+	auto& store = *this->budget->store();
+	auto min_run = all ? size_t{ 1 } : std::min(this->budget->batch(), ResultBudget::min_run);
+	static const DistancesInFile no_distances{};
+	static const ContextInFile no_contexts{};
+	std::vector<size_t> entries{};
+	std::vector<SpillHits> batch{};
+	for (size_t i = 0; i != matches.positions.size(); ++i)
+	{
+		if (matches.positions[i].empty() || matches.positions[i].size() * store.hit_size() < min_run)
+			continue;
+		entries.push_back(i);
+		batch.push_back({ matches.positions[i], this->mismatch_limit != 0 ? matches.distances[i] : no_distances, this->context_size != 0 ? matches.contexts[i] : no_contexts });
+	}
+	if (batch.empty())
+		return;
+
+	auto runs = store.write(batch);
+	for (size_t j = 0; j != entries.size(); ++j)
+	{
+		auto i = entries[j];
+		// A run that starts where the previous one of the pattern ends extends it.
+		auto& spilled = matches.spilled[i];
+		if (!spilled.empty() && spilled.back().offset + spilled.back().count * store.hit_size() == runs[j].offset)
+			spilled.back().count += runs[j].count;
+		else
+			spilled.push_back(runs[j]);
+		this->budget->release(matches.positions[i].size() * store.hit_size());
+		// Swapped out rather than cleared, so the memory is actually returned.
+		PositionsInFile{}.swap(matches.positions[i]);
+		if (this->mismatch_limit != 0)
+			DistancesInFile{}.swap(matches.distances[i]);
+		if (this->context_size != 0)
+			ContextInFile{}.swap(matches.contexts[i]);
+	}
+}
+void Search::flatten(ScanMatches& found, FileMatches& matches)
+{
+	std::vector<size_t> order(found.patterns.size());
+	std::iota(order.begin(), order.end(), size_t{ 0 });
+	std::sort(order.begin(), order.end(), [&found](size_t l, size_t r) { return found.patterns[l] < found.patterns[r]; });
+	size_t total = 0;
+	for (const auto& e : found.positions)
+		total += e.size();
+	matches.patterns.reserve(order.size());
+	matches.firsts.reserve(order.size());
+	matches.positions.reserve(total);
+	// Every entry is released once copied, so the file is never held twice in full.
+	for (auto i : order)
+	{
+		matches.patterns.push_back(found.patterns[i]);
+		matches.firsts.push_back(matches.positions.size());
+		matches.positions.insert(matches.positions.end(), found.positions[i].cbegin(), found.positions[i].cend());
+		PositionsInFile{}.swap(found.positions[i]);
+		if (!found.contexts.empty())
+		{
+			matches.contexts.insert(matches.contexts.end(), found.contexts[i].cbegin(), found.contexts[i].cend());
+			ContextInFile{}.swap(found.contexts[i]);
+		}
+		if (!found.distances.empty())
+		{
+			matches.distances.insert(matches.distances.end(), found.distances[i].cbegin(), found.distances[i].cend());
+			DistancesInFile{}.swap(found.distances[i]);
+		}
+		if (!found.spilled.empty())
+			matches.spilled.push_back(std::move(found.spilled[i]));
+		if (!found.truncated.empty())
+			matches.truncated.push_back(found.truncated[i]);
+	}
+}
+std::string_view Search::pattern_bytes(PatternId i) const noexcept
+{
+	if (this->compiled)
+		return this->compiled->pattern(i);
+	const auto& bytes = this->tofind[i].get();
+	return { bytes.data(), bytes.size() };
+}
 void Search::sort_paths()
 {
+	HEXCORE_TRACE_SPAN(span, TracePhase::Stat, this->paths.size());
 	std::sort(this->paths.begin(), this->paths.end());
 	auto last = std::unique(this->paths.begin(), this->paths.end());
 	this->paths.erase(last, this->paths.end());
 	std::sort(this->paths.begin(), this->paths.end(), [](const Path& p1, const Path& p2) { return fs::file_size(p1) > fs::file_size(p2); }); // < or > ?
 }
-std::vector<std::vector<unsigned>> Search::group_paths_for_threads()
+Search::DedupPlan Search::dedup_paths() const
 {
-	sort_paths();
-	this->threads_number = paths.size() >= this->threads_number ? this->threads_number : paths.size();
-	std::vector<std::vector<unsigned>> groups_of_paths_indexes(this->threads_number, std::vector<unsigned>{});
-	std::vector<uintmax_t> filessize_per_thread(this->threads_number, 0);
-	auto get_group = [&filessize_per_thread](const Path& p) {
-		auto filesize = fs::file_size(p);
-		if (filessize_per_thread.empty())
+	constexpr size_t ends_size = 4096;
+
+	DedupPlan plan{};
+	plan.origin.assign(this->paths.size(), false);
+	if (this->dedup == Dedup::None)
+	{
+		plan.scan.resize(this->paths.size());
+		std::iota(plan.scan.begin(), plan.scan.end(), 0u);
+		return plan;
+	}
+
+	std::unordered_map<FileIdentity, unsigned, FileIdentityHasher> by_identity{};
+	std::vector<unsigned> distinct{};
+	for (unsigned i = 0; i != this->paths.size(); ++i)
+	{
+		auto id = identify_file(this->paths[i]);
+		if (id)
 		{
-			*filessize_per_thread.begin() += filesize;
-			return unsigned(0);
+			auto [it, inserted] = by_identity.emplace(*id, i);
+			if (!inserted)
+			{
+				plan.aliases.emplace(i, Alias{ it->second, true });
+				plan.origin[it->second] = true;
+				continue;
+			}
 		}
-		auto it = std::min_element(filessize_per_thread.begin(), filessize_per_thread.end());
-		*it += filesize;
-		return static_cast<unsigned>(std::distance(filessize_per_thread.begin(), it));
-	};
-	for (auto it = this->paths.cbegin(); it != this->paths.cend(); ++it)
-		groups_of_paths_indexes.at(get_group(*it)).push_back(std::distance(this->paths.cbegin(), it));
-	
-	return groups_of_paths_indexes;
+		distinct.push_back(i);
+	}
+
+	if (this->dedup == Dedup::Content)
+	{
+		std::unordered_map<uintmax_t, std::vector<unsigned>> by_size{};
+		for (auto i : distinct)
+		{
+			std::error_code ec{};
+			auto size = fs::file_size(this->paths[i], ec);
+			if (!ec)
+				by_size[size].push_back(i);
+		}
+		for (const auto& [size, group] : by_size)
+		{
+			if (group.size() < 2)
+				continue;
+			std::map<ContentHash, unsigned> by_ends{};
+			for (auto i : group)
+			{
+				auto hash = ContentHasher::hash_ends(this->paths[i], ends_size);
+				if (!hash)
+					continue;
+				auto [it, inserted] = by_ends.emplace(*hash, i);
+				if (!inserted)
+				{
+					plan.aliases.emplace(i, Alias{ it->second, false });
+					plan.origin[it->second] = true;
+				}
+			}
+		}
+
+		// A hard link to a content alias is served from the scanned origin, so it
+		// has to be compared with it as well.
+		for (auto& [i, alias] : plan.aliases)
+		{
+			auto it = plan.aliases.find(alias.origin);
+			if (it == plan.aliases.cend() || it->second.same_inode)
+				continue;
+			alias = Alias{ it->second.origin, false };
+		}
+		for (const auto& [i, alias] : plan.aliases)
+			plan.origin[i] = false;
+	}
+
+	for (auto i : distinct)
+		if (!plan.aliases.contains(i))
+			plan.scan.push_back(i);
+
+	return plan;
 }
+bool Search::same_content(const Path& origin, const Path& path, size_t slice_size) const noexcept
+{
+	try
+	{
+		auto window = std::max<size_t>(slice_size, 1 << 20);
+		IfstreamWindow left{ origin, window, 0, this->read_mode };
+		IfstreamWindow right{ path, window, 0, this->read_mode };
+		if (left.file_size() != right.file_size())
+			return false;
+		// Both files are read with the same windows, so equal files give equal windows.
+		for (;;)
+		{
+			bool more = left.next();
+			if (more != right.next())
+				return false;
+			if (!more)
+				return true;
+			if (left.size() != right.size() || std::memcmp(left.data(), right.data(), left.size()) != 0)
+				return false;
+		}
+	}
+	catch (...)
+	{
+	}
 
+	return false;
+}
@@ -1,21 +1,43 @@
 #pragma once
 #include <iterator>
+#include <list>
 #include <memory>
 #include <unordered_set>
+#include <unordered_map>
 #include <optional>
 #include <fstream>
 #include <functional>
 #include <atomic>
+#include <array>
+#include <vector>
+#include <string_view>
+#include <mutex>
+#include <thread>
+#include <span>
+#include "FileIdentity.h"
+#include "PathFilter.h"
+#include "FileReader.h"
+#include "ApproximateMatcher.h"
+#include "PatternSet.h"
+#include "Spill.h"
 
 class RawBytes;
 struct RawBytesHasher;
 struct RawBytesComparator;
 using RawBytesIt = std::vector<char>::iterator;
 using RawBytesSet = std::unordered_set<RawBytes, RawBytesHasher>;
-using Path = std::wstring;
+using RawBytesList = std::vector<RawBytes>;
+using PatternId = std::size_t;
+using FileId = std::size_t;
 using PositionsInFile = std::vector<uintmax_t>;
+using HitPositions = std::span<const uintmax_t>;
+using ContextInFile = std::vector<char>;
+using DistancesInFile = std::vector<uint8_t>;
 using ProgressCallback = std::function<void(unsigned)>;
+struct FileMatches;
+using FileResultCallback = std::function<void(Path, FileMatches)>;
 using UnopenedFiles = std::optional<std::vector<Path>>;
+using MatchKernel = const char* (*)(const char*, const char*, const char*, std::size_t) noexcept;
 
 
 struct __declspec(dllexport)RawBytesHasher
@@ -60,10 +82,131 @@ private:
 private:
 	std::vector<char> seq;
 };
+inline const std::vector<char>& RawBytes::get() const noexcept
+{
+	return this->seq;
+}
+inline size_t RawBytes::size() const noexcept
+{
+	return this->get().size();
+}
 __declspec(dllexport) std::ostream& operator<<(std::ostream&, const RawBytes&);
 __declspec(dllexport) std::wostream& operator<<(std::wostream&, const RawBytes&);
 
 
+// Pattern known at build time: "4d5a"_hex and "MZ"_bytes are checked while compiling
+// and convert to RawBytes, so they can be passed straight to Search::add_bytes.
+template <std::size_t N>
+class FixedBytes
+{
+public:
+	static constexpr std::size_t size = N;
+
+	constexpr FixedBytes() = default;
+	constexpr FixedBytes(const std::array<char, N>& src) : seq{ src } {	}
+	constexpr const std::array<char, N>& get() const noexcept { return seq; }
+	operator RawBytes() const { return RawBytes{ std::vector<char>(seq.cbegin(), seq.cend()) }; }
+
+private:
+	std::array<char, N> seq{};
+};
+
+template <std::size_t N>
+struct HexLiteral
+{
+	static constexpr std::size_t size = N / 2;
+	std::array<char, N / 2> bytes{};
+
+	consteval HexLiteral(const char(&str)[N])
+	{
+		for (std::size_t i = 0; i + 1 < N; ++i)
+		{
+			char ch = str[i];
+			char nibble = (ch >= '0' && ch <= '9') ? ch - '0'
+				: (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+				: (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10
+				: throw "not a hex digit";
+			bytes[i / 2] |= (i % 2 == 0) ? static_cast<char>(nibble << 4) : nibble;
+		}
+	}
+};
+
+template <std::size_t N>
+struct TextLiteral
+{
+	static constexpr std::size_t size = N - 1;
+	std::array<char, N - 1> bytes{};
+
+	consteval TextLiteral(const char(&str)[N])
+	{
+		for (std::size_t i = 0; i + 1 < N; ++i)
+			bytes[i] = str[i];
+	}
+};
+
+template <HexLiteral L>
+consteval FixedBytes<decltype(L)::size> operator""_hex()
+{
+	static_assert(decltype(L)::size != 0, "Empty sequence");
+	return FixedBytes<decltype(L)::size>{ L.bytes };
+}
+
+template <TextLiteral L>
+consteval FixedBytes<decltype(L)::size> operator""_bytes()
+{
+	static_assert(decltype(L)::size != 0, "Empty sequence");
+	return FixedBytes<decltype(L)::size>{ L.bytes };
+}
+
+
+class __declspec(dllexport) IfstreamWindow
+{
+public:
+	IfstreamWindow() = delete;
+	IfstreamWindow(const IfstreamWindow&) = delete;
+	IfstreamWindow(IfstreamWindow&& other) = default;
+	~IfstreamWindow() = default;
+	IfstreamWindow& operator=(const IfstreamWindow&) = delete;
+	IfstreamWindow& operator=(IfstreamWindow&&) = default;
+
+	// With skip_holes the window jumps over holes of a sparse file that are at least one
+	// window long. A hole is still read for one overlap past its data, and the window that
+	// follows it starts with an overlap of zeros, so only matches that lie entirely in
+	// zeros are missed.
+	IfstreamWindow(const Path&, std::size_t, std::size_t, ReadMode = ReadMode::Buffered, bool skip_holes = false);
+
+	bool next();
+	const char* data() const noexcept;
+	std::size_t size() const noexcept;
+	uintmax_t offset() const noexcept;
+	uintmax_t file_size() const noexcept;
+	bool last() const noexcept;
+
+private:
+	bool skip_hole();
+
+private:
+	// The buffer is split into a prefix that receives the overlap carried over from the
+	// previous window, right-aligned, and a body that every read fills from its aligned
+	// start, as unbuffered I/O requires.
+	std::ifstream file;
+	std::optional<NativeFile> native;
+	AlignedBuffer buffer;
+	std::size_t prefix;
+	std::size_t body;
+	std::size_t start{ 0 };
+	std::size_t filled{ 0 };
+	std::size_t overlap;
+	uintmax_t window_offset{ 0 };
+	uintmax_t read_offset{ 0 };
+	uintmax_t total_size;
+	bool started{ false };
+	// Unset when holes are not skipped; empty for a file that is one hole.
+	std::optional<std::vector<DataExtent>> extents{};
+	std::size_t extent{ 0 };
+};
+
+
 class __declspec(dllexport) IfstreamSlicer
 {
 public:
@@ -98,9 +241,72 @@ private:
 };
 
 
+// Everything found in one file. Only patterns that were found have an entry: patterns holds
+// their ids in increasing order and firsts the index of the first hit of each in positions,
+// whose hits run up to the first hit of the next entry.
+// With a context size of N every hit owns 2 * N bytes of its pattern's context: N bytes
+// before the match, then N bytes after it. Bytes that fall outside the file are zero here
+// and trimmed by SearchRes::context. distances holds one byte per hit.
+// Under a memory budget the earlier hits of a pattern may have been moved to the store:
+// its runs in spilled come before the hits still in positions. truncated marks the
+// patterns that lost hits to a hard cap. Both have one element per entry, or none when no
+// budget was set.
+struct FileMatches
+{
+	std::vector<PatternId> patterns;
+	std::vector<size_t> firsts;
+	PositionsInFile positions;
+	ContextInFile contexts;
+	DistancesInFile distances;
+	uintmax_t file_size{ 0 };
+	std::vector<std::vector<SpillRun>> spilled;
+	std::vector<bool> truncated;
+	std::shared_ptr<const SpillStore> store;
+};
+
+struct MatchContext
+{
+	std::string_view before;
+	std::string_view after;
+};
+
+// One hit as SearchRes::for_each_hit hands it out; the context is valid during the call.
+struct MatchHit
+{
+	uintmax_t position;
+	unsigned distance;
+	MatchContext context;
+};
+using HitCallback = std::function<void(const MatchHit&)>;
+
+
+// Shared between Search and the caller while exec_and_reset runs; every field may be read
+// from any thread. Setting cancelled stops the search after the current window of every file.
+struct SearchProgress
+{
+	std::atomic<unsigned> files{ 0 };
+	std::atomic<uintmax_t> bytes{ 0 };
+	std::atomic<uintmax_t> total_bytes{ 0 };
+	std::atomic<bool> cancelled{ false };
+};
+
+
+// Only the (file, pattern) pairs that were found have an entry. Entries are file-major and
+// by pattern within a file; every file owns a range of them and a pair is looked up by a
+// binary search of its pattern in that range. The hits of all entries lie back to back in
+// one array of positions, with their contexts and distances in arrays of the same order.
+// Pattern ids are the ones returned by Search::add_bytes or of the compiled set, which is
+// shared rather than copied; file ids follow collect_paths().
+// A file added with add_alias has no entries of its own and reads those of its origin.
+// Pairs with hits spilled to disk are read back by at(), context() and distance() and kept
+// in a cache of at most max_loaded bytes, least recently used first out. What those return
+// for a spilled pair stays valid until another spilled pair is loaded. hits() and
+// for_each_hit() never load more than a bounded chunk of them.
 class __declspec(dllexport) SearchRes
 {
 public:
+	static constexpr size_t max_loaded = size_t{ 64 } << 20;
+
 	SearchRes() = default;
 	SearchRes(const SearchRes&) = delete;
 	SearchRes(SearchRes&&) = default;
@@ -108,33 +314,127 @@ public:
 	SearchRes& operator=(const SearchRes&) = delete;
 	SearchRes& operator=(SearchRes&&) = default;
 
-	SearchRes(RawBytesSet, std::unordered_map<Path, std::vector<PositionsInFile>>, UnopenedFiles);
-	SearchRes(RawBytesSet, UnopenedFiles);
-
-	RawBytesSet::const_iterator rowbytes_cbegin() const;
-	RawBytesSet::const_iterator rowbytes_cend() const;
-
-	const PositionsInFile& at(const Path&, const RawBytes&) const;
+	SearchRes(RawBytesList, std::vector<Path>, std::vector<PositionsInFile>, UnopenedFiles);
+	SearchRes(RawBytesList, UnopenedFiles);
+	explicit SearchRes(RawBytesList, size_t context_size = 0, unsigned max_mismatches = 0);
+	explicit SearchRes(std::shared_ptr<const PatternSet>, size_t context_size = 0, unsigned max_mismatches = 0);
+
+	size_t patterns_count() const noexcept;
+	size_t files_count() const noexcept;
+	std::string_view pattern(PatternId) const;
+	const Path& path(FileId) const;
+	std::optional<FileId> find_file(const Path&) const noexcept;
+	std::optional<PatternId> find_pattern(const RawBytes&) const noexcept;
+
+	uintmax_t file_size(FileId) const;
+	size_t context_size() const noexcept;
+	MatchContext context(FileId, PatternId, size_t) const;
+	unsigned max_mismatches() const noexcept;
+	unsigned distance(FileId, PatternId, size_t) const;
+
+	size_t hits(FileId, PatternId) const;
+	bool truncated(FileId, PatternId) const;
+	// Patterns of the file that have an entry, in increasing order.
+	std::span<const PatternId> patterns_found(FileId) const;
+	// Calls back for the hits [first, last) of a pair, by increasing position.
+	void for_each_hit(FileId, PatternId, size_t, size_t, const HitCallback&) const;
+
+	HitPositions at(FileId, PatternId) const;
+	HitPositions at(const Path&, PatternId) const;
+	HitPositions at(const Path&, const RawBytes&) const;
 	bool contains(const Path&) const;
 	std::vector<Path> collect_paths() const noexcept;
 	const UnopenedFiles& unopened_files() const noexcept;
 	bool empty() const noexcept;
 
+	FileId add_file(Path, FileMatches);
+	FileId add_alias(Path, FileId);
+	void add_unopened(Path);
 	void reset() noexcept;
 
 
 private:
-	RawBytesSet tofind{};
-	std::unordered_map<Path, std::vector<PositionsInFile>> data{};
+	RawBytesList tofind{};
+	std::shared_ptr<const PatternSet> set{};
+	std::vector<Path> files{};
+	std::unordered_map<Path, FileId> files_index{};
+	// Pattern of every entry, and the index of its first hit in data; an entry ends where
+	// the next one starts.
+	std::vector<PatternId> found{};
+	std::vector<size_t> firsts{};
+	PositionsInFile data{};
+	// First and past-the-last entry of every file.
+	std::vector<std::pair<size_t, size_t>> ranges{};
+	std::vector<uintmax_t> sizes{};
+	size_t context_bytes{ 0 };
+	ContextInFile contexts{};
+	unsigned mismatch_limit{ 0 };
+	DistancesInFile distances{};
 	UnopenedFiles skipped;
+
+	struct SpilledHits
+	{
+		std::shared_ptr<const SpillStore> store;
+		std::vector<SpillRun> runs;
+		size_t count;
+	};
+	struct LoadedHits
+	{
+		PositionsInFile positions;
+		ContextInFile contexts;
+		DistancesInFile distances;
+	};
+	struct LoadCache
+	{
+		std::mutex mutex;
+		// Slots, most recently used first.
+		std::list<size_t> order;
+		std::unordered_map<size_t, std::pair<LoadedHits, std::list<size_t>::iterator>> pairs;
+		size_t bytes{ 0 };
+	};
+	struct HitsRef
+	{
+		HitPositions positions;
+		std::span<const char> contexts;
+		std::span<const uint8_t> distances;
+	};
+
+	std::optional<size_t> slot(FileId, PatternId) const;
+	std::pair<size_t, size_t> entry_hits(size_t) const noexcept;
+	HitsRef hits_of(std::optional<size_t>) const;
+	MatchContext make_context(FileId, PatternId, uintmax_t, const char*) const noexcept;
+
+	std::unordered_map<size_t, SpilledHits> spilled{};
+	std::unordered_set<size_t> truncation{};
+	std::shared_ptr<LoadCache> loaded = std::make_shared<LoadCache>();
 };
 
 
+// How Search treats files with the same data: HardLinks scans one path per device and
+// file index, Content also groups files by size and a hash of their ends, and compares
+// every alias with its origin byte by byte before reusing the results of the origin.
+enum class Dedup { None, HardLinks, Content };
+
 class __declspec(dllexport) Search
 {
-	RawBytesSet tofind = {};
+	RawBytesList tofind = {};
+	std::unordered_map<RawBytes, PatternId, RawBytesHasher> tofind_index = {};
 	std::vector<Path> paths = {};
-	unsigned threads_number = std::thread::hardware_concurrency() - 1;
+	unsigned threads_number = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	size_t context_size = 0;
+	Dedup dedup = Dedup::None;
+	PathFilter filter{};
+	ReadMode read_mode = ReadMode::Buffered;
+	unsigned mismatch_limit = 0;
+	std::vector<ApproximateMatcher> matchers = {};
+	std::shared_ptr<const PatternSet> compiled = {};
+	bool skip_holes = false;
+	size_t memory_budget = 0;
+	BudgetPolicy budget_policy = BudgetPolicy::Spill;
+	Path spill_directory = {};
+	std::unique_ptr<ResultBudget> budget = {};
+
+	friend class ShardCoordinator;
 
 public:
 	Search() = default;
@@ -147,18 +447,63 @@ public:
 	Search(Path, RawBytesSet = {});
 
 	size_t size() const noexcept;
-	bool add_bytes(RawBytes) noexcept;
+	const RawBytesList& patterns() const noexcept;
+	std::optional<PatternId> add_bytes(RawBytes) noexcept;
 	bool add_path(Path) noexcept;
+	void set_context_size(size_t) noexcept;
+	void set_dedup(Dedup) noexcept;
+	void set_filter(PathFilter) noexcept;
+	void set_read_mode(ReadMode) noexcept;
+	void set_max_mismatches(unsigned) noexcept;
+	// A compiled set replaces the patterns added one by one: add_bytes is refused while it
+	// is installed, patterns() stays empty and pattern ids are the ids of the set.
+	void set_pattern_set(std::shared_ptr<const PatternSet>) noexcept;
+	const std::shared_ptr<const PatternSet>& pattern_set() const noexcept;
+	// Caps the memory taken by hits; zero means no limit. Spilled hits go to the given
+	// directory, or to the system temporary directory when it is empty.
+	void set_memory_budget(size_t, BudgetPolicy = BudgetPolicy::Spill, Path = {}) noexcept;
 	void reset() noexcept;
 
 	bool ready() const noexcept;
 
-	SearchRes exec_and_reset(size_t, std::atomic<unsigned>&);
+	// With a callback every scanned file is handed to it from the worker thread as soon as
+	// it is done, and the returned SearchRes carries only the patterns and unopened files.
+	SearchRes exec_and_reset(size_t, SearchProgress&, FileResultCallback = {});
 
 private:
-	static std::vector<PositionsInFile> search_bytes_in_file(const RawBytesSet&, const Path&, size_t, std::atomic<unsigned>& progress);
+	struct Alias
+	{
+		unsigned origin;
+		bool same_inode;
+	};
+	struct DedupPlan
+	{
+		std::vector<unsigned> scan;
+		std::unordered_map<unsigned, Alias> aliases;
+		std::vector<bool> origin;
+	};
+
+	// Hits of a file while it is scanned: one entry per pattern found so far, in the order
+	// they were first found, each with its own vectors so that it grows on its own.
+	struct ScanMatches
+	{
+		std::vector<PatternId> patterns;
+		std::vector<PositionsInFile> positions;
+		std::vector<ContextInFile> contexts;
+		std::vector<DistancesInFile> distances;
+		std::vector<std::vector<SpillRun>> spilled;
+		std::vector<bool> truncated;
+	};
+
+	FileMatches search_bytes_in_file(const Path&, size_t, SearchProgress&, std::atomic<uintmax_t>* = nullptr) const;
+	bool same_content(const Path&, const Path&, size_t) const noexcept;
+	static MatchKernel select_kernel(std::size_t) noexcept;
+	size_t patterns_count() const noexcept;
+	std::string_view pattern_bytes(PatternId) const noexcept;
+	void spill(ScanMatches&, bool = false) const;
+	static void flatten(ScanMatches&, FileMatches&);
 	
 	void sort_paths();
-	std::vector<std::vector<unsigned>> group_paths_for_threads();
+	DedupPlan dedup_paths() const;
 
 };
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <unordered_map>
+#include "IoScheduler.h"
+
+IoScheduler::IoScheduler(const std::vector<Path>& paths, const std::vector<unsigned>& indexes, unsigned initial_workers, unsigned max_workers)
+	: max_workers{ std::max(max_workers, 1u) }, threads{ 0 }
+{
+	std::unordered_map<uint64_t, size_t> by_device{};
+	for (auto i : indexes)
+	{
+		auto id = identify_file(paths[i]);
+		auto [it, inserted] = by_device.emplace(id ? id->device : 0, this->devices.size());
+		if (inserted)
+		{
+			this->devices.push_back(std::make_unique<Device>());
+			this->devices.back()->limit = std::clamp(initial_workers, 1u, this->max_workers);
+		}
+		this->devices[it->second]->pending.push_back(i);
+	}
+	// Pending files are taken from the back, so the largest ones start first.
+	for (auto& device : this->devices)
+	{
+		std::reverse(device->pending.begin(), device->pending.end());
+		this->pending += device->pending.size();
+	}
+
+	auto start = Clock::now();
+	for (auto& device : this->devices)
+		device->sample_start = start;
+	this->threads = static_cast<unsigned>(std::min<size_t>(this->pending, this->max_workers));
+}
+unsigned IoScheduler::workers() const noexcept
+{
+	return this->threads;
+}
+std::optional<IoScheduler::Task> IoScheduler::next()
+{
+	std::unique_lock<std::mutex> lock{ this->mutex };
+	while (true)
+	{
+		if (this->cancelled || this->pending == 0)
+			return {};
+
+		auto now = Clock::now();
+		Device* best = nullptr;
+		size_t best_index = 0;
+		for (size_t i = 0; i != this->devices.size(); ++i)
+		{
+			auto& device = *this->devices[i];
+			this->adjust(device, now);
+			if (device.pending.empty() || device.active >= device.limit)
+				continue;
+			// Prefer the device that is furthest below its own limit.
+			if (!best || device.limit - device.active > best->limit - best->active)
+			{
+				best = &device;
+				best_index = i;
+			}
+		}
+		if (best)
+		{
+			++best->active;
+			--this->pending;
+			auto index = best->pending.back();
+			best->pending.pop_back();
+			return Task{ index, best_index, best->read_ahead, &best->transferred };
+		}
+
+		// Every device with work is at its limit; wait for a file to finish, but wake up
+		// now and then so that a raised limit is noticed.
+		this->slot_freed.wait_for(lock, sample_period);
+	}
+}
+void IoScheduler::done(const Task& task)
+{
+	{
+		std::lock_guard<std::mutex> lock{ this->mutex };
+		auto& device = *this->devices[task.device];
+		--device.active;
+		this->adjust(device, Clock::now());
+	}
+	this->slot_freed.notify_all();
+}
+void IoScheduler::cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock{ this->mutex };
+		this->cancelled = true;
+	}
+	this->slot_freed.notify_all();
+}
+void IoScheduler::adjust(Device& device, Clock::time_point now)
+{
+	auto elapsed = std::chrono::duration<double>(now - device.sample_start).count();
+	if (elapsed < std::chrono::duration<double>(sample_period).count())
+		return;
+
+	auto total = device.transferred.load(std::memory_order_relaxed);
+	auto rate = (total - device.sampled) / elapsed;
+	device.sampled = total;
+	device.sample_start = now;
+	// An idle device tells nothing about its limits.
+	if (device.active == 0 || rate == 0)
+		return;
+
+	if (device.last_rate != 0)
+	{
+		if (rate < device.last_rate * 0.95)
+			device.step = -device.step;
+		else if (rate <= device.last_rate * 1.05)
+			device.step = -1;
+	}
+	device.last_rate = rate;
+
+	if (device.step > 0)
+	{
+		if (device.read_ahead > 1)
+			device.read_ahead /= 2;
+		else if (device.limit < this->max_workers)
+			++device.limit;
+	}
+	else
+	{
+		if (device.limit > 1)
+			--device.limit;
+		else if (device.read_ahead < max_read_ahead)
+			device.read_ahead *= 2;
+	}
+}
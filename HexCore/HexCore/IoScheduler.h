@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "FileIdentity.h"
+
+// Hands files to search threads, grouped by the device they live on. Every device has
+// its own limit of concurrently read files and its own read-ahead factor (a multiplier
+// of the slice size). Both are tuned while the search runs by hill climbing on the
+// measured throughput: a change that raised the device's bytes per second is repeated,
+// one that lowered it is reversed, and a flat result drifts towards fewer readers. A
+// device that is best served by a single reader (a spinning disk that seeks) gets a
+// larger read-ahead instead, so it reads longer sequential runs.
+class IoScheduler
+{
+public:
+	struct Task
+	{
+		unsigned index;
+		size_t device;
+		size_t read_ahead;
+		std::atomic<uintmax_t>* transferred;
+	};
+
+	IoScheduler() = delete;
+	IoScheduler(const IoScheduler&) = delete;
+	IoScheduler(IoScheduler&&) = delete;
+	~IoScheduler() = default;
+	IoScheduler& operator=(const IoScheduler&) = delete;
+	IoScheduler& operator=(IoScheduler&&) = delete;
+
+	// Indexes must be given largest file first. Every device starts with the first number
+	// of readers and may grow up to the second, which is also the number of threads.
+	IoScheduler(const std::vector<Path>&, const std::vector<unsigned>&, unsigned, unsigned);
+
+	unsigned workers() const noexcept;
+	std::optional<Task> next();
+	void done(const Task&);
+	void cancel();
+
+	static constexpr size_t max_read_ahead = 16;
+	static constexpr std::chrono::milliseconds sample_period{ 250 };
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Device
+	{
+		std::vector<unsigned> pending{};
+		unsigned active = 0;
+		unsigned limit = 1;
+		size_t read_ahead = 1;
+		int step = 1;
+		double last_rate = 0;
+		uintmax_t sampled = 0;
+		Clock::time_point sample_start{};
+		std::atomic<uintmax_t> transferred{ 0 };
+	};
+
+	void adjust(Device&, Clock::time_point);
+
+private:
+	std::mutex mutex{};
+	std::condition_variable slot_freed{};
+	std::vector<std::unique_ptr<Device>> devices{};
+	size_t pending = 0;
+	unsigned max_workers;
+	unsigned threads;
+	bool cancelled = false;
+};
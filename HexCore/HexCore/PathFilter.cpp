@@ -0,0 +1,138 @@
+#include <cwctype>
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/stat.h>
+#endif
+#include "PathFilter.h"
+
+namespace fs = std::filesystem;
+
+void PathFilter::include(Path glob)
+{
+	this->includes.push_back(std::move(glob));
+}
+void PathFilter::exclude(Path glob)
+{
+	this->excludes.push_back(std::move(glob));
+}
+void PathFilter::skip_directory(Path glob)
+{
+	this->skipped.push_back(std::move(glob));
+}
+void PathFilter::set_size_range(std::optional<uintmax_t> min, std::optional<uintmax_t> max) noexcept
+{
+	this->min_size = min;
+	this->max_size = max;
+}
+void PathFilter::set_time_range(std::optional<fs::file_time_type> from, std::optional<fs::file_time_type> to) noexcept
+{
+	this->modified_from = from;
+	this->modified_to = to;
+}
+void PathFilter::set_same_filesystem(bool f) noexcept
+{
+	this->one_filesystem = f;
+}
+bool PathFilter::same_filesystem() const noexcept
+{
+	return this->one_filesystem;
+}
+bool PathFilter::empty() const noexcept
+{
+	return this->includes.empty() && this->excludes.empty() && this->skipped.empty()
+		&& !this->min_size && !this->max_size && !this->modified_from && !this->modified_to && !this->one_filesystem;
+}
+bool PathFilter::accepts_file(const fs::directory_entry& entry) const
+{
+	auto name = entry.path().filename().wstring();
+	if (!this->includes.empty() && !match_any(this->includes, name))
+		return false;
+	if (match_any(this->excludes, name))
+		return false;
+
+	if (!this->min_size && !this->max_size && !this->modified_from && !this->modified_to)
+		return true;
+
+#ifdef _WIN32
+	// The directory listing already returned the size and the write time, and
+	// directory_entry keeps them, so neither costs a system call.
+	auto size = entry.file_size();
+	auto time = entry.last_write_time();
+#else
+	// Here directory_entry keeps only the file type, and each accessor would stat the
+	// file again; one stat gives both.
+	struct stat info {};
+	if (stat(entry.path().c_str(), &info) != 0)
+		throw fs::filesystem_error("Bad file access", entry.path(), std::error_code{ errno, std::generic_category() });
+	auto size = static_cast<uintmax_t>(info.st_size);
+	auto since_epoch = std::chrono::seconds{ info.st_mtim.tv_sec } + std::chrono::nanoseconds{ info.st_mtim.tv_nsec };
+	auto time = std::chrono::file_clock::from_sys(std::chrono::sys_time<std::chrono::nanoseconds>{ since_epoch });
+#endif
+	if ((this->min_size && size < *this->min_size) || (this->max_size && size > *this->max_size))
+		return false;
+	if ((this->modified_from && time < *this->modified_from) || (this->modified_to && time > *this->modified_to))
+		return false;
+
+	return true;
+}
+bool PathFilter::accepts_directory(const fs::directory_entry& entry, std::optional<uint64_t> device) const
+{
+	if (match_any(this->skipped, entry.path().filename().wstring()))
+		return false;
+	if (this->one_filesystem && device)
+	{
+		auto id = identify_file(entry.path().wstring());
+		if (!id || id->device != *device)
+			return false;
+	}
+
+	return true;
+}
+bool PathFilter::match_glob(std::wstring_view glob, std::wstring_view name) noexcept
+{
+	auto same = [](wchar_t l, wchar_t r) {
+#ifdef _WIN32
+		return std::towlower(l) == std::towlower(r);
+#else
+		return l == r;
+#endif
+	};
+
+	// Greedy match that backtracks only to the last '*', which is enough for globs
+	// without character classes.
+	size_t g = 0, n = 0, star = std::wstring_view::npos, resume = 0;
+	while (n != name.size())
+	{
+		if (g != glob.size() && (glob[g] == L'?' || (glob[g] != L'*' && same(glob[g], name[n]))))
+		{
+			++g;
+			++n;
+		}
+		else if (g != glob.size() && glob[g] == L'*')
+		{
+			star = g++;
+			resume = n;
+		}
+		else if (star != std::wstring_view::npos)
+		{
+			g = star + 1;
+			n = ++resume;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (g != glob.size() && glob[g] == L'*')
+		++g;
+
+	return g == glob.size();
+}
+bool PathFilter::match_any(const std::vector<Path>& globs, std::wstring_view name) noexcept
+{
+	for (const auto& glob : globs)
+		if (match_glob(glob, name))
+			return true;
+
+	return false;
+}
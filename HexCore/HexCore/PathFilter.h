@@ -0,0 +1,49 @@
+#pragma once
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include "FileIdentity.h"
+
+// Rules applied by Search::add_path while it walks a directory. Globs support '*' and '?'
+// and are matched against the file or directory name only ("*.log", "node_modules").
+// A file is taken when it matches at least one include glob (or there are none), no
+// exclude glob, and the size and modification time windows. A directory that matches a
+// skipped glob, or lies on another device when same_filesystem is set, is not descended.
+class __declspec(dllexport) PathFilter
+{
+public:
+	PathFilter() = default;
+	PathFilter(const PathFilter&) = default;
+	PathFilter(PathFilter&&) = default;
+	~PathFilter() = default;
+	PathFilter& operator=(const PathFilter&) = default;
+	PathFilter& operator=(PathFilter&&) = default;
+
+	void include(Path);
+	void exclude(Path);
+	void skip_directory(Path);
+	void set_size_range(std::optional<uintmax_t>, std::optional<uintmax_t>) noexcept;
+	void set_time_range(std::optional<std::filesystem::file_time_type>, std::optional<std::filesystem::file_time_type>) noexcept;
+	void set_same_filesystem(bool) noexcept;
+	bool same_filesystem() const noexcept;
+	bool empty() const noexcept;
+
+	bool accepts_file(const std::filesystem::directory_entry&) const;
+	bool accepts_directory(const std::filesystem::directory_entry&, std::optional<uint64_t>) const;
+
+	static bool match_glob(std::wstring_view, std::wstring_view) noexcept;
+
+private:
+	static bool match_any(const std::vector<Path>&, std::wstring_view) noexcept;
+
+private:
+	std::vector<Path> includes{};
+	std::vector<Path> excludes{};
+	std::vector<Path> skipped{};
+	std::optional<uintmax_t> min_size{};
+	std::optional<uintmax_t> max_size{};
+	std::optional<std::filesystem::file_time_type> modified_from{};
+	std::optional<std::filesystem::file_time_type> modified_to{};
+	bool one_filesystem = false;
+};
@@ -0,0 +1,384 @@
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "HexCore.h"
+#include "PatternSet.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	uint64_t aligned(uint64_t size)
+	{
+		return (size + 7) / 8 * 8;
+	}
+
+	int hex_digit(char ch) noexcept
+	{
+		if (ch >= '0' && ch <= '9') return ch - '0';
+		if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+		if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+		return -1;
+	}
+
+	std::optional<std::string> parse_hex(std::string_view line)
+	{
+		std::string res{};
+		int high = -1;
+		for (auto ch : line)
+		{
+			if (ch == ' ' || ch == '\t')
+				continue;
+			auto digit = hex_digit(ch);
+			if (digit < 0)
+				return {};
+			if (high < 0)
+				high = digit;
+			else
+			{
+				res.push_back(static_cast<char>(high << 4 | digit));
+				high = -1;
+			}
+		}
+		if (high >= 0)
+			return {};
+		return res;
+	}
+
+	std::optional<std::string> parse_quoted(std::string_view line)
+	{
+		if (line.size() < 2 || line.front() != '"' || line.back() != '"')
+			return {};
+		line = line.substr(1, line.size() - 2);
+
+		std::string res{};
+		for (size_t i = 0; i != line.size(); ++i)
+		{
+			if (line[i] != '\\')
+			{
+				if (line[i] == '"')
+					return {};
+				res.push_back(line[i]);
+				continue;
+			}
+			if (++i == line.size())
+				return {};
+			switch (line[i])
+			{
+			case 'n': res.push_back('\n'); break;
+			case 'r': res.push_back('\r'); break;
+			case 't': res.push_back('\t'); break;
+			case '0': res.push_back('\0'); break;
+			case '\\': res.push_back('\\'); break;
+			case '"': res.push_back('"'); break;
+			case 'x':
+			{
+				if (i + 2 >= line.size())
+					return {};
+				auto high = hex_digit(line[i + 1]);
+				auto low = hex_digit(line[i + 2]);
+				if (high < 0 || low < 0)
+					return {};
+				res.push_back(static_cast<char>(high << 4 | low));
+				i += 2;
+				break;
+			}
+			default:
+				return {};
+			}
+		}
+		return res;
+	}
+
+	std::string_view trim(std::string_view line) noexcept
+	{
+		while (!line.empty() && (line.front() == ' ' || line.front() == '\t'))
+			line.remove_prefix(1);
+		while (!line.empty() && (line.back() == ' ' || line.back() == '\t'))
+			line.remove_suffix(1);
+		return line;
+	}
+}
+
+PatternSet::PatternSet(std::shared_ptr<const char> data, uint64_t size) : storage{ std::move(data) }
+{
+	auto bad = []() { return std::runtime_error("Corrupted pattern set"); };
+	if (size < sizeof(PatternSetHeader))
+		throw bad();
+	std::memcpy(&this->header, this->storage.get(), sizeof(PatternSetHeader));
+	const auto& h = this->header;
+	if (!std::equal(std::begin(h.magic), std::end(h.magic), std::begin(PatternSetHeader::signature)))
+		throw std::runtime_error("Not a pattern set");
+	if (h.version != PatternSetHeader::current_version)
+		throw std::runtime_error("Unsupported pattern set version");
+	if (h.total_size != size || h.patterns >= UINT32_MAX)
+		throw bad();
+
+	auto section = [&](uint64_t offset, uint64_t count, uint64_t item) {
+		if (offset % 8 != 0 || offset > size || count > (size - offset) / item)
+			throw bad();
+		return this->storage.get() + offset;
+	};
+	this->offsets = reinterpret_cast<const uint64_t*>(section(h.offsets_offset, h.patterns + 1, sizeof(uint64_t)));
+	if (this->offsets[0] != 0)
+		throw bad();
+	uint64_t min_size = h.patterns == 0 ? 0 : UINT64_MAX, max_size = 0;
+	for (uint64_t i = 0; i != h.patterns; ++i)
+	{
+		if (this->offsets[i + 1] <= this->offsets[i])
+			throw bad();
+		min_size = std::min(min_size, this->offsets[i + 1] - this->offsets[i]);
+		max_size = std::max(max_size, this->offsets[i + 1] - this->offsets[i]);
+	}
+	// The window overlap is derived from max_size, so it has to be the real one.
+	if (h.min_size != min_size || h.max_size != max_size)
+		throw bad();
+	this->bytes = section(h.bytes_offset, this->offsets[h.patterns], 1);
+
+	// scan() trusts the buckets: every pattern is listed exactly once, one-byte patterns
+	// under their byte and longer ones under their leading pair.
+	std::vector<bool> listed(static_cast<size_t>(h.patterns), false);
+	auto ids = [&](uint64_t table_offset, uint64_t buckets, uint64_t ids_offset, const uint32_t*& table, const uint32_t*& list) {
+		table = reinterpret_cast<const uint32_t*>(section(table_offset, buckets + 1, sizeof(uint32_t)));
+		if (table[0] != 0)
+			throw bad();
+		for (uint64_t i = 0; i != buckets; ++i)
+			if (table[i + 1] < table[i])
+				throw bad();
+		list = reinterpret_cast<const uint32_t*>(section(ids_offset, table[buckets], sizeof(uint32_t)));
+		bool single = buckets == 1 << 8;
+		for (uint64_t key = 0; key != buckets; ++key)
+			for (auto i = table[key]; i != table[key + 1]; ++i)
+			{
+				auto id = list[i];
+				if (id >= h.patterns || listed[id])
+					throw bad();
+				listed[id] = true;
+				auto size = this->offsets[id + 1] - this->offsets[id];
+				auto p = this->bytes + this->offsets[id];
+				if (single ? size != 1 || static_cast<unsigned char>(p[0]) != key
+					: size < 2 || static_cast<uint64_t>(static_cast<unsigned char>(p[0]) << 8 | static_cast<unsigned char>(p[1])) != key)
+					throw bad();
+			}
+	};
+	ids(h.pairs_offset, 1 << 16, h.pair_ids_offset, this->pairs, this->pair_ids);
+	ids(h.singles_offset, 1 << 8, h.single_ids_offset, this->singles, this->single_ids);
+	if (std::find(listed.cbegin(), listed.cend(), false) != listed.cend())
+		throw bad();
+}
+std::shared_ptr<const PatternSet> PatternSet::compile(const RawBytesList& list)
+{
+	// Duplicates and empty patterns are dropped; ids follow the first occurrence.
+	std::vector<std::string_view> patterns{};
+	std::unordered_set<std::string_view> seen{};
+	for (const auto& raw : list)
+	{
+		std::string_view view{ raw.get().data(), raw.size() };
+		if (!view.empty() && seen.insert(view).second)
+			patterns.push_back(view);
+	}
+	if (patterns.size() >= UINT32_MAX)
+		throw std::length_error("Too many patterns");
+
+	uint64_t total_bytes = 0, min_size = patterns.empty() ? 0 : UINT64_MAX, max_size = 0;
+	std::vector<uint32_t> pair_counts(1 << 16, 0), single_counts(1 << 8, 0);
+	for (auto p : patterns)
+	{
+		total_bytes += p.size();
+		min_size = std::min<uint64_t>(min_size, p.size());
+		max_size = std::max<uint64_t>(max_size, p.size());
+		if (p.size() == 1)
+			++single_counts[static_cast<unsigned char>(p[0])];
+		else
+			++pair_counts[static_cast<unsigned char>(p[0]) << 8 | static_cast<unsigned char>(p[1])];
+	}
+	uint64_t singles_total = std::accumulate(single_counts.cbegin(), single_counts.cend(), uint64_t{ 0 });
+	uint64_t pairs_total = patterns.size() - singles_total;
+
+	PatternSetHeader h{};
+	std::copy(std::begin(PatternSetHeader::signature), std::end(PatternSetHeader::signature), h.magic);
+	h.version = PatternSetHeader::current_version;
+	h.patterns = patterns.size();
+	h.min_size = min_size;
+	h.max_size = max_size;
+	h.offsets_offset = aligned(sizeof(PatternSetHeader));
+	h.bytes_offset = h.offsets_offset + (h.patterns + 1) * sizeof(uint64_t);
+	h.pairs_offset = h.bytes_offset + aligned(total_bytes);
+	h.pair_ids_offset = h.pairs_offset + aligned(((1 << 16) + 1) * sizeof(uint32_t));
+	h.singles_offset = h.pair_ids_offset + aligned(pairs_total * sizeof(uint32_t));
+	h.single_ids_offset = h.singles_offset + aligned(((1 << 8) + 1) * sizeof(uint32_t));
+	h.total_size = h.single_ids_offset + aligned(singles_total * sizeof(uint32_t));
+
+	std::shared_ptr<char> data{ reinterpret_cast<char*>(new uint64_t[h.total_size / 8]{}), [](char* p) { delete[] reinterpret_cast<uint64_t*>(p); } };
+	auto base = data.get();
+	std::memcpy(base, &h, sizeof(h));
+
+	auto offsets = reinterpret_cast<uint64_t*>(base + h.offsets_offset);
+	uint64_t offset = 0;
+	for (size_t i = 0; i != patterns.size(); ++i)
+	{
+		offsets[i] = offset;
+		std::memcpy(base + h.bytes_offset + offset, patterns[i].data(), patterns[i].size());
+		offset += patterns[i].size();
+	}
+	offsets[patterns.size()] = offset;
+
+	auto fill = [&patterns](uint64_t table_offset, uint64_t ids_offset, const std::vector<uint32_t>& counts, char* base, bool single) {
+		auto table = reinterpret_cast<uint32_t*>(base + table_offset);
+		auto ids = reinterpret_cast<uint32_t*>(base + ids_offset);
+		table[0] = 0;
+		for (size_t i = 0; i != counts.size(); ++i)
+			table[i + 1] = table[i] + counts[i];
+		std::vector<uint32_t> next(table, table + counts.size());
+		for (uint32_t id = 0; id != patterns.size(); ++id)
+		{
+			auto p = patterns[id];
+			if ((p.size() == 1) != single)
+				continue;
+			auto key = single ? static_cast<unsigned char>(p[0]) : static_cast<unsigned char>(p[0]) << 8 | static_cast<unsigned char>(p[1]);
+			ids[next[key]++] = id;
+		}
+	};
+	fill(h.pairs_offset, h.pair_ids_offset, pair_counts, base, false);
+	fill(h.singles_offset, h.single_ids_offset, single_counts, base, true);
+
+	return std::shared_ptr<const PatternSet>{ new PatternSet{ std::move(data), h.total_size } };
+}
+std::shared_ptr<const PatternSet> PatternSet::load_signatures(const Path& path, SignatureFormat format)
+{
+	auto lines = parse_signatures(path, format);
+	RawBytesList list{};
+	list.reserve(lines.size());
+	for (auto& line : lines)
+		list.emplace_back(std::vector<char>(line.cbegin(), line.cend()));
+	return compile(list);
+}
+std::shared_ptr<const PatternSet> PatternSet::load(const Path& path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Bad file access");
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		throw std::runtime_error("Not a pattern set");
+	}
+	HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		throw std::runtime_error("Bad file access");
+	auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view)
+		throw std::runtime_error("Bad file access");
+	std::shared_ptr<const char> data{ static_cast<const char*>(view), [](const char* p) { UnmapViewOfFile(p); } };
+	auto total = static_cast<uint64_t>(size.QuadPart);
+#else
+	int fd = ::open(fs::path{ path }.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("Bad file access");
+	struct stat st {};
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		throw std::runtime_error("Not a pattern set");
+	}
+	auto total = static_cast<uint64_t>(st.st_size);
+	auto view = mmap(nullptr, static_cast<size_t>(total), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (view == MAP_FAILED)
+		throw std::runtime_error("Bad file access");
+	std::shared_ptr<const char> data{ static_cast<const char*>(view), [total](const char* p) { munmap(const_cast<char*>(p), static_cast<size_t>(total)); } };
+#endif
+	return std::shared_ptr<const PatternSet>{ new PatternSet{ std::move(data), total } };
+}
+void PatternSet::save(const Path& path) const
+{
+	std::ofstream out{ fs::path{ path }, std::ios::binary | std::ios::trunc };
+	if (!out)
+		throw std::runtime_error("Bad file access");
+	out.write(this->storage.get(), static_cast<std::streamsize>(this->header.total_size));
+	out.flush();
+	if (!out)
+		throw std::runtime_error("Write failed");
+}
+size_t PatternSet::size() const noexcept
+{
+	return static_cast<size_t>(this->header.patterns);
+}
+bool PatternSet::empty() const noexcept
+{
+	return this->header.patterns == 0;
+}
+std::string_view PatternSet::pattern(PatternId id) const noexcept
+{
+	return { this->bytes + this->offsets[id], static_cast<size_t>(this->offsets[id + 1] - this->offsets[id]) };
+}
+size_t PatternSet::min_size() const noexcept
+{
+	return static_cast<size_t>(this->header.min_size);
+}
+size_t PatternSet::max_size() const noexcept
+{
+	return static_cast<size_t>(this->header.max_size);
+}
+RawBytesList PatternSet::to_list() const
+{
+	RawBytesList list{};
+	list.reserve(this->size());
+	for (PatternId id = 0; id != this->size(); ++id)
+	{
+		auto p = this->pattern(id);
+		list.emplace_back(std::vector<char>(p.cbegin(), p.cend()));
+	}
+	return list;
+}
+std::vector<std::string> PatternSet::parse_signatures(const Path& path, SignatureFormat format)
+{
+	std::ifstream in{ fs::path{ path }, std::ios::binary };
+	if (!in)
+		throw std::runtime_error("Bad file access");
+
+	std::vector<std::string> res{};
+	std::string line{};
+	size_t number = 0;
+	while (std::getline(in, line))
+	{
+		++number;
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (format == SignatureFormat::Text)
+		{
+			if (!line.empty())
+				res.push_back(line);
+			continue;
+		}
+
+		auto view = trim(line);
+		if (view.empty() || view.front() == '#')
+			continue;
+		auto pattern = (format == SignatureFormat::Auto && view.front() == '"') ? parse_quoted(view) : parse_hex(view);
+		if (!pattern)
+			throw std::runtime_error("Bad signature at line " + std::to_string(number));
+		res.push_back(std::move(*pattern));
+	}
+
+	return res;
+}
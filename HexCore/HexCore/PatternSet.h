@@ -0,0 +1,114 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include "FileIdentity.h"
+
+class RawBytes;
+using RawBytesList = std::vector<RawBytes>;
+using PatternId = std::size_t;
+
+// Layout of a compiled pattern set, both in memory and on disk. All fields use the host
+// byte order and every section starts on an 8-byte boundary, so a saved set is used
+// straight from a read-only memory mapping:
+//   offsets_offset    -> uint64_t[patterns + 1] byte offsets into the pattern bytes
+//   bytes_offset      -> char[] concatenated patterns, in PatternId order
+//   pairs_offset      -> uint32_t[65536 + 1] first index into pair_ids for every leading byte pair
+//   pair_ids_offset   -> uint32_t[] ids of the patterns of two bytes or more, grouped by leading pair
+//   singles_offset    -> uint32_t[256 + 1] first index into single_ids for every byte
+//   single_ids_offset -> uint32_t[] ids of the one-byte patterns, grouped by byte
+struct PatternSetHeader
+{
+	static constexpr char signature[4] = { 'H', 'X', 'P', 'S' };
+	static constexpr uint32_t current_version = 1;
+
+	char magic[4];
+	uint32_t version;
+	uint64_t patterns;
+	uint64_t min_size;
+	uint64_t max_size;
+	uint64_t offsets_offset;
+	uint64_t bytes_offset;
+	uint64_t pairs_offset;
+	uint64_t pair_ids_offset;
+	uint64_t singles_offset;
+	uint64_t single_ids_offset;
+	uint64_t total_size;
+};
+
+// Immutable, compiled list of patterns. Patterns are stored back to back in one block
+// instead of one heap vector each, and indexed by their first two bytes so that one pass
+// over a buffer finds every pattern. A set is shared between Search objects and threads
+// through std::shared_ptr<const PatternSet>; nothing in it changes after construction.
+class __declspec(dllexport) PatternSet
+{
+public:
+	// Signature files hold one pattern per line. Hex lines are hex digits with optional
+	// spaces; in Auto mode a line in double quotes is text with C escapes (\n, \t, \\, \",
+	// \xHH). Both skip empty lines and lines starting with '#'. Text takes every non-empty
+	// line literally.
+	enum class SignatureFormat { Auto, Hex, Text };
+
+	PatternSet() = delete;
+	PatternSet(const PatternSet&) = delete;
+	PatternSet(PatternSet&&) = default;
+	~PatternSet() = default;
+	PatternSet& operator=(const PatternSet&) = delete;
+	PatternSet& operator=(PatternSet&&) = default;
+
+	static std::shared_ptr<const PatternSet> compile(const RawBytesList&);
+	static std::shared_ptr<const PatternSet> load_signatures(const Path&, SignatureFormat = SignatureFormat::Auto);
+	static std::shared_ptr<const PatternSet> load(const Path&);
+	void save(const Path&) const;
+
+	size_t size() const noexcept;
+	bool empty() const noexcept;
+	std::string_view pattern(PatternId) const noexcept;
+	size_t min_size() const noexcept;
+	size_t max_size() const noexcept;
+	RawBytesList to_list() const;
+
+	// Calls on_match(id, position) for every occurrence of every pattern that lies
+	// entirely in [first, last), by increasing position.
+	template <class OnMatch>
+	void scan(const char* first, const char* last, OnMatch&& on_match) const;
+
+private:
+	PatternSet(std::shared_ptr<const char>, uint64_t);
+	static std::vector<std::string> parse_signatures(const Path&, SignatureFormat);
+
+private:
+	std::shared_ptr<const char> storage;
+	PatternSetHeader header;
+	const uint64_t* offsets;
+	const char* bytes;
+	const uint32_t* pairs;
+	const uint32_t* pair_ids;
+	const uint32_t* singles;
+	const uint32_t* single_ids;
+};
+
+template <class OnMatch>
+void PatternSet::scan(const char* first, const char* last, OnMatch&& on_match) const
+{
+	for (const char* p = first; p < last; ++p)
+	{
+		auto rest = static_cast<uint64_t>(last - p);
+		auto c0 = static_cast<unsigned char>(p[0]);
+		for (auto i = this->singles[c0]; i != this->singles[c0 + 1]; ++i)
+			on_match(static_cast<PatternId>(this->single_ids[i]), p);
+		if (rest < 2)
+			continue;
+
+		auto key = c0 << 8 | static_cast<unsigned char>(p[1]);
+		for (auto i = this->pairs[key]; i != this->pairs[key + 1]; ++i)
+		{
+			auto id = this->pair_ids[i];
+			auto size = this->offsets[id + 1] - this->offsets[id];
+			if (size <= rest && std::memcmp(p, this->bytes + this->offsets[id], static_cast<size_t>(size)) == 0)
+				on_match(static_cast<PatternId>(id), p);
+		}
+	}
+}
@@ -0,0 +1,180 @@
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <cstddef>
+#include <unordered_set>
+#include "ResultReader.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	// Older versions have a shorter header: version 2 ends before the unopened files
+	// section, version 3 before the distances, version 4 before the truncation flags.
+	constexpr size_t header_v2_size = offsetof(BinaryResultHeader, unopened);
+	constexpr size_t header_v3_size = offsetof(BinaryResultHeader, max_mismatches);
+	constexpr size_t header_v4_size = offsetof(BinaryResultHeader, truncated_offset);
+}
+
+ResultReader::ResultReader(const Path& path)
+{
+	std::ifstream in{ fs::path{ path }, std::ios::binary };
+	if (!in)
+		throw std::runtime_error("Bad file access");
+	this->storage_size = fs::file_size(fs::path{ path });
+	this->storage.resize((this->storage_size + 7) / 8);
+	in.read(reinterpret_cast<char*>(this->storage.data()), this->storage_size);
+	if (static_cast<uint64_t>(in.gcount()) != this->storage_size)
+		throw std::runtime_error("Bad file access");
+
+	if (this->storage_size < header_v2_size)
+		throw std::runtime_error("Not a result file");
+	std::memcpy(&this->header, this->storage.data(), header_v2_size);
+	if (!std::equal(std::begin(this->header.magic), std::end(this->header.magic), std::begin(BinaryResultHeader::signature)))
+		throw std::runtime_error("Not a result file");
+	if (this->header.version < 2 || this->header.version > BinaryResultHeader::current_version)
+		throw std::runtime_error("Unsupported result file version");
+	auto header_size = this->header.version == 2 ? header_v2_size : this->header.version == 3 ? header_v3_size : this->header.version == 4 ? header_v4_size : sizeof(BinaryResultHeader);
+	if (this->storage_size < header_size)
+		throw std::runtime_error("Corrupted result file");
+	std::memcpy(&this->header, this->storage.data(), header_size);
+
+	const auto& h = this->header;
+	auto cells = h.files * h.patterns;
+	if (h.patterns != 0 && cells / h.patterns != h.files)
+		throw std::runtime_error("Corrupted result file");
+	auto index = this->words(h.index_offset, cells + 1);
+	if (index[cells] != h.positions)
+		throw std::runtime_error("Corrupted result file");
+	for (uint64_t i = 0; i != cells; ++i)
+		if (index[i] > index[i + 1])
+			throw std::runtime_error("Corrupted result file");
+	this->words(h.positions_offset, h.positions);
+	this->words(h.sizes_offset, h.files);
+	if (h.context_size != 0)
+	{
+		if (h.positions > (this->storage_size / 2) / h.context_size)
+			throw std::runtime_error("Corrupted result file");
+		this->bytes(h.contexts_offset, h.positions * 2 * h.context_size);
+	}
+	if (h.max_mismatches > 255)
+		throw std::runtime_error("Corrupted result file");
+	if (h.max_mismatches != 0)
+		this->bytes(h.distances_offset, h.positions);
+	if (h.version >= 5)
+		this->bytes(h.truncated_offset, cells);
+}
+RawBytesList ResultReader::patterns() const
+{
+	RawBytesList res{};
+	res.reserve(this->header.patterns);
+	for (uint64_t i = 0; i != this->header.patterns; ++i)
+	{
+		auto pattern = this->string(this->header.patterns_offset, this->header.patterns, i);
+		res.emplace_back(std::vector<char>(pattern.cbegin(), pattern.cend()));
+	}
+
+	return res;
+}
+size_t ResultReader::context_size() const noexcept
+{
+	return static_cast<size_t>(this->header.context_size);
+}
+unsigned ResultReader::max_mismatches() const noexcept
+{
+	return static_cast<unsigned>(this->header.max_mismatches);
+}
+size_t ResultReader::files_count() const noexcept
+{
+	return static_cast<size_t>(this->header.files);
+}
+void ResultReader::append_to(SearchRes& res) const
+{
+	const auto& h = this->header;
+	if (res.patterns_count() != h.patterns || res.context_size() != h.context_size || res.max_mismatches() != h.max_mismatches)
+		throw std::logic_error("Wrong data");
+	for (uint64_t i = 0; i != h.patterns; ++i)
+		if (this->string(h.patterns_offset, h.patterns, i) != res.pattern(static_cast<PatternId>(i)))
+			throw std::logic_error("Wrong data");
+
+	auto index = this->words(h.index_offset, h.files * h.patterns + 1);
+	auto positions = this->words(h.positions_offset, h.positions);
+	auto sizes = this->words(h.sizes_offset, h.files);
+	auto contexts = h.context_size != 0 ? this->bytes(h.contexts_offset, h.positions * 2 * h.context_size).data() : nullptr;
+	auto distances = h.max_mismatches != 0 ? reinterpret_cast<const uint8_t*>(this->bytes(h.distances_offset, h.positions).data()) : nullptr;
+	auto truncated = h.version >= 5 ? this->bytes(h.truncated_offset, h.files * h.patterns).data() : nullptr;
+
+	// Everything is read and checked before the result is touched, so a file that cannot
+	// be appended leaves it as it was.
+	std::vector<std::pair<Path, FileMatches>> files{};
+	files.reserve(static_cast<size_t>(h.files));
+	std::unordered_set<Path> seen{};
+	for (uint64_t file = 0; file != h.files; ++file)
+	{
+		auto path = from_utf8(this->string(h.paths_offset, h.files, file));
+		if (res.contains(path) || !seen.insert(path).second)
+			throw std::logic_error("Path is already added");
+
+		// The hits of a file are stored back to back, as FileMatches holds them.
+		FileMatches matches{};
+		matches.file_size = sizes[file];
+		auto begin = index[file * h.patterns], end = index[(file + 1) * h.patterns];
+		matches.positions.assign(positions + begin, positions + end);
+		if (contexts)
+			matches.contexts.assign(contexts + begin * 2 * h.context_size, contexts + end * 2 * h.context_size);
+		if (distances)
+			matches.distances.assign(distances + begin, distances + end);
+		for (uint64_t pattern = 0; pattern != h.patterns; ++pattern)
+		{
+			auto first = index[file * h.patterns + pattern];
+			auto last = index[file * h.patterns + pattern + 1];
+			bool cut = truncated && truncated[file * h.patterns + pattern] != 0;
+			if (first == last && !cut)
+				continue;
+			matches.patterns.push_back(static_cast<PatternId>(pattern));
+			matches.firsts.push_back(static_cast<size_t>(first - begin));
+			if (truncated)
+				matches.truncated.push_back(cut);
+		}
+		files.emplace_back(std::move(path), std::move(matches));
+	}
+	std::vector<Path> unopened{};
+	if (h.version >= 3)
+		for (uint64_t i = 0; i != h.unopened; ++i)
+			unopened.push_back(from_utf8(this->string(h.unopened_offset, h.unopened, i)));
+
+	for (auto& [path, matches] : files)
+		res.add_file(std::move(path), std::move(matches));
+	for (auto& path : unopened)
+		res.add_unopened(std::move(path));
+}
+SearchRes ResultReader::read() const
+{
+	SearchRes res{ this->patterns(), this->context_size(), this->max_mismatches() };
+	this->append_to(res);
+	return res;
+}
+std::string_view ResultReader::bytes(uint64_t offset, uint64_t size) const
+{
+	if (offset > this->storage_size || size > this->storage_size - offset)
+		throw std::runtime_error("Corrupted result file");
+	return { reinterpret_cast<const char*>(this->storage.data()) + offset, static_cast<size_t>(size) };
+}
+const uint64_t* ResultReader::words(uint64_t offset, uint64_t count) const
+{
+	if (offset % 8 != 0 || count > this->storage_size / 8)
+		throw std::runtime_error("Corrupted result file");
+	return reinterpret_cast<const uint64_t*>(this->bytes(offset, count * 8).data());
+}
+std::string_view ResultReader::string(uint64_t section, uint64_t count, uint64_t i) const
+{
+	auto offsets = this->words(section, count + 1);
+	if (offsets[i] > offsets[i + 1])
+		throw std::runtime_error("Corrupted result file");
+	return this->bytes(section + (count + 1) * 8 + offsets[i], offsets[i + 1] - offsets[i]);
+}
+Path ResultReader::from_utf8(std::string_view str)
+{
+	return fs::path{ std::u8string(str.cbegin(), str.cend()) }.wstring();
+}
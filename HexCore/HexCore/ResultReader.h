@@ -0,0 +1,40 @@
+#pragma once
+#include "ResultWriter.h"
+
+// Loads files written with ResultWriter::Format::Binary. The file is read once into an
+// 8-aligned buffer and every section is bounds-checked before use; a malformed file
+// throws std::runtime_error.
+class __declspec(dllexport) ResultReader
+{
+public:
+	ResultReader() = delete;
+	ResultReader(const ResultReader&) = delete;
+	ResultReader(ResultReader&&) = default;
+	~ResultReader() = default;
+	ResultReader& operator=(const ResultReader&) = delete;
+	ResultReader& operator=(ResultReader&&) = default;
+
+	explicit ResultReader(const Path&);
+
+	RawBytesList patterns() const;
+	size_t context_size() const noexcept;
+	unsigned max_mismatches() const noexcept;
+	size_t files_count() const noexcept;
+
+	// Adds the stored files, in stored order, after the ones already in the result. The
+	// result must have been created for the same patterns, context size and mismatch limit
+	// and must not hold any of the stored paths yet; otherwise nothing is added.
+	void append_to(SearchRes&) const;
+	SearchRes read() const;
+
+private:
+	std::string_view bytes(uint64_t, uint64_t) const;
+	const uint64_t* words(uint64_t, uint64_t) const;
+	std::string_view string(uint64_t, uint64_t, uint64_t) const;
+	static Path from_utf8(std::string_view);
+
+private:
+	std::vector<uint64_t> storage{};
+	uint64_t storage_size = 0;
+	BinaryResultHeader header{};
+};
@@ -0,0 +1,538 @@
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <charconv>
+#include <cwctype>
+#include <algorithm>
+#include "ResultWriter.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	constexpr size_t positions_per_block = 1 << 16;
+	constexpr size_t write_buffer_size = 1 << 22;
+
+	static_assert(sizeof(PositionsInFile::value_type) == sizeof(uint64_t), "Binary format stores positions as uint64_t");
+
+	void append_number(std::vector<char>& out, uintmax_t value)
+	{
+		char buff[24];
+		auto res = std::to_chars(std::begin(buff), std::end(buff), value);
+		out.insert(out.end(), buff, res.ptr);
+	}
+
+	void append_text(std::vector<char>& out, std::string_view text)
+	{
+		out.insert(out.end(), text.cbegin(), text.cend());
+	}
+
+	// A chunk buffer takes many blocks, so growing it by each block's estimate alone
+	// would reallocate on every block.
+	void reserve_more(std::vector<char>& out, size_t size)
+	{
+		if (out.capacity() - out.size() < size)
+			out.reserve(std::max(out.size() + size, 2 * out.capacity()));
+	}
+
+	void write_u64(std::ofstream& out, uint64_t value)
+	{
+		out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	void write_padding(std::ofstream& out, uint64_t written)
+	{
+		static constexpr char zeros[8]{};
+		if (written % 8)
+			out.write(zeros, 8 - written % 8);
+	}
+
+	uint64_t aligned(uint64_t size)
+	{
+		return (size + 7) / 8 * 8;
+	}
+
+	// Offsets section followed by the concatenated strings, padded to 8 bytes.
+	void write_strings(std::ofstream& out, const std::vector<std::string>& strings)
+	{
+		uint64_t offset = 0;
+		for (const auto& str : strings)
+		{
+			write_u64(out, offset);
+			offset += str.size();
+		}
+		write_u64(out, offset);
+		for (const auto& str : strings)
+			out.write(str.data(), str.size());
+		write_padding(out, (strings.size() + 1) * sizeof(uint64_t) + offset);
+	}
+}
+
+ResultWriter::ResultWriter(const SearchRes& res, Format format) : res{ res }, format{ format }
+{
+	if (format == Format::Binary)
+		return;
+
+	std::vector<char> buff{};
+	this->paths_utf8.reserve(res.files_count());
+	for (FileId i = 0; i != res.files_count(); ++i)
+	{
+		buff.clear();
+		this->append_quoted(buff, to_utf8(res.path(i)));
+		this->paths_utf8.emplace_back(buff.cbegin(), buff.cend());
+	}
+	this->patterns_hex.reserve(res.patterns_count());
+	for (PatternId i = 0; i != res.patterns_count(); ++i)
+	{
+		buff.clear();
+		append_hex(buff, res.pattern(i));
+		this->patterns_hex.emplace_back(buff.cbegin(), buff.cend());
+	}
+}
+void ResultWriter::write(const Path& path) const
+{
+	std::vector<char> stream_buffer(write_buffer_size);
+	std::ofstream out{};
+	out.rdbuf()->pubsetbuf(stream_buffer.data(), stream_buffer.size());
+	out.open(fs::path{ path }, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::runtime_error("Bad file access");
+
+	if (this->format == Format::Binary)
+		this->write_binary(out);
+	else
+		this->write_text(out);
+
+	out.flush();
+	if (!out)
+		throw std::runtime_error("Write failed");
+}
+std::optional<ResultWriter::Format> ResultWriter::format_by_extension(const Path& path) noexcept
+{
+	try
+	{
+		auto ext = fs::path{ path }.extension().wstring();
+		std::transform(ext.begin(), ext.end(), ext.begin(), [](wchar_t ch) { return static_cast<wchar_t>(std::towlower(ch)); });
+		if (ext == L".csv")
+			return Format::Csv;
+		if (ext == L".ndjson" || ext == L".jsonl")
+			return Format::Ndjson;
+		if (ext == L".hxrs" || ext == L".bin")
+			return Format::Binary;
+	}
+	catch (...)
+	{
+	}
+
+	return {};
+}
+std::vector<ResultWriter::Chunk> ResultWriter::split_chunks() const
+{
+	// NDJSON keeps distances and contexts in their own arrays after the positions
+	std::vector<Section> sections{ Section::Positions };
+	if (this->format == Format::Ndjson && this->res.max_mismatches() != 0)
+		sections.push_back(Section::Distances);
+	if (this->format == Format::Ndjson && this->res.context_size() != 0)
+		sections.push_back(Section::Contexts);
+
+	// A block weighs its hits plus one for the record around them, so a run of empty
+	// NDJSON records is packed like a run of hits.
+	std::vector<Chunk> chunks{ Chunk{} };
+	size_t weight = 0;
+	auto add = [&chunks, &weight](const Block& block) {
+		if (weight >= positions_per_block)
+		{
+			chunks.emplace_back();
+			weight = 0;
+		}
+		chunks.back().push_back(block);
+		weight += block.last - block.first + 1;
+	};
+	auto add_pair = [this, &sections, &add](FileId file, PatternId pattern) {
+		auto count = this->res.hits(file, pattern);
+		for (auto section : sections)
+		{
+			if (count == 0)
+				add({ file, pattern, 0, 0, section });
+			for (size_t first = 0; first < count; first += positions_per_block)
+				add({ file, pattern, first, std::min(count, first + positions_per_block), section });
+		}
+	};
+	// CSV has no row for a pair without hits, so it only visits the pairs that were found;
+	// NDJSON still writes a record for every pair.
+	for (FileId file = 0; file != this->res.files_count(); ++file)
+	{
+		if (this->format == Format::Ndjson)
+			for (PatternId pattern = 0; pattern != this->res.patterns_count(); ++pattern)
+				add_pair(file, pattern);
+		else
+			for (auto pattern : this->res.patterns_found(file))
+				if (this->res.hits(file, pattern) != 0)
+					add_pair(file, pattern);
+	}
+	if (chunks.back().empty())
+		chunks.pop_back();
+
+	return chunks;
+}
+void ResultWriter::format_block(const Block& block, std::vector<char>& out) const
+{
+	const auto& path = this->paths_utf8.at(block.file);
+	const auto& pattern = this->patterns_hex.at(block.pattern);
+	auto context_size = this->res.context_size();
+	auto approximate = this->res.max_mismatches() != 0;
+	auto i = block.first;
+
+	if (this->format == Format::Csv)
+	{
+		reserve_more(out, (block.last - block.first) * (path.size() + pattern.size() + 28 + 4 * context_size));
+		this->res.for_each_hit(block.file, block.pattern, block.first, block.last, [&](const MatchHit& hit) {
+			append_text(out, path);
+			out.push_back(',');
+			append_text(out, pattern);
+			out.push_back(',');
+			append_number(out, hit.position);
+			if (approximate)
+			{
+				out.push_back(',');
+				append_number(out, hit.distance);
+			}
+			if (context_size != 0)
+			{
+				out.push_back(',');
+				append_hex(out, hit.context.before);
+				out.push_back(',');
+				append_hex(out, hit.context.after);
+			}
+			out.push_back('\n');
+		});
+		return;
+	}
+
+	if (block.section == Section::Contexts)
+	{
+		reserve_more(out, (block.last - block.first) * (4 * context_size + 8) + 4);
+		this->res.for_each_hit(block.file, block.pattern, block.first, block.last, [&](const MatchHit& hit) {
+			append_text(out, i++ != 0 ? ",[\"" : "[\"");
+			append_hex(out, hit.context.before);
+			append_text(out, "\",\"");
+			append_hex(out, hit.context.after);
+			append_text(out, "\"]");
+		});
+	}
+	else if (block.section == Section::Distances)
+	{
+		reserve_more(out, (block.last - block.first) * 4 + 24);
+		this->res.for_each_hit(block.file, block.pattern, block.first, block.last, [&](const MatchHit& hit) {
+			if (i++ != 0)
+				out.push_back(',');
+			append_number(out, hit.distance);
+		});
+	}
+	else
+	{
+		reserve_more(out, (block.last - block.first) * 21 + path.size() + pattern.size() + 48);
+		if (block.first == 0)
+		{
+			append_text(out, "{\"path\":");
+			append_text(out, path);
+			append_text(out, ",\"pattern\":\"");
+			append_text(out, pattern);
+			append_text(out, "\",\"positions\":[");
+		}
+		this->res.for_each_hit(block.file, block.pattern, block.first, block.last, [&](const MatchHit& hit) {
+			if (i++ != 0)
+				out.push_back(',');
+			append_number(out, hit.position);
+		});
+	}
+	if (block.last == this->res.hits(block.file, block.pattern))
+		append_text(out, this->section_end(block));
+}
+const char* ResultWriter::section_end(const Block& block) const
+{
+	if (block.section == Section::Positions && this->res.max_mismatches() != 0)
+		return "],\"distances\":[";
+	if (block.section != Section::Contexts && this->res.context_size() != 0)
+		return "],\"context\":[";
+	return this->res.truncated(block.file, block.pattern) ? "],\"truncated\":true}\n" : "]}\n";
+}
+void ResultWriter::write_text(std::ofstream& out) const
+{
+	if (this->format == Format::Csv)
+	{
+		out << "path,pattern,position";
+		if (this->res.max_mismatches() != 0)
+			out << ",distance";
+		out << (this->res.context_size() != 0 ? ",before,after\n" : "\n");
+	}
+
+	// A fixed pool of workers formats chunks into a window of buffers while this thread
+	// writes them out in order; a worker does not run more than a window ahead.
+	auto chunks = this->split_chunks();
+	auto workers = std::max<size_t>(std::min<size_t>(this->threads_number, chunks.size()), 1);
+	auto window = 2 * workers;
+	std::vector<std::vector<char>> buffers(window);
+	std::vector<bool> ready(window, false);
+	std::mutex mutex{};
+	std::condition_variable changed{};
+	size_t next = 0, written = 0;
+	bool stop = false;
+	std::exception_ptr error{};
+
+	auto work = [&]() {
+		for (;;)
+		{
+			size_t i = 0;
+			{
+				std::unique_lock<std::mutex> lock{ mutex };
+				changed.wait(lock, [&]() { return stop || next == chunks.size() || next < written + window; });
+				if (stop || next == chunks.size())
+					return;
+				i = next++;
+			}
+			auto& buff = buffers[i % window];
+			try
+			{
+				buff.clear();
+				for (const auto& block : chunks[i])
+					this->format_block(block, buff);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock{ mutex };
+				if (!error)
+					error = std::current_exception();
+				stop = true;
+				changed.notify_all();
+				return;
+			}
+			std::lock_guard<std::mutex> lock{ mutex };
+			ready[i % window] = true;
+			changed.notify_all();
+		}
+	};
+	std::vector<std::future<void>> futures{};
+	futures.reserve(workers);
+	for (size_t i = 0; i != workers; ++i)
+		futures.push_back(std::async(std::launch::async, work));
+
+	for (size_t i = 0; i != chunks.size(); ++i)
+	{
+		{
+			std::unique_lock<std::mutex> lock{ mutex };
+			changed.wait(lock, [&]() { return stop || ready[i % window]; });
+			if (stop)
+				break;
+		}
+		const auto& buff = buffers[i % window];
+		out.write(buff.data(), buff.size());
+		std::lock_guard<std::mutex> lock{ mutex };
+		ready[i % window] = false;
+		++written;
+		changed.notify_all();
+	}
+	for (auto& future : futures)
+		future.get();
+	if (error)
+		std::rethrow_exception(error);
+}
+void ResultWriter::write_binary(std::ofstream& out) const
+{
+	uint64_t patterns = this->res.patterns_count();
+	uint64_t files = this->res.files_count();
+
+	std::vector<std::string> paths{};
+	paths.reserve(files);
+	uint64_t paths_size = 0;
+	for (FileId i = 0; i != files; ++i)
+	{
+		paths.push_back(to_utf8(this->res.path(i)));
+		paths_size += paths.back().size();
+	}
+	uint64_t patterns_size = 0;
+	for (PatternId i = 0; i != patterns; ++i)
+		patterns_size += this->res.pattern(i).size();
+	uint64_t total = 0;
+	for (FileId file = 0; file != files; ++file)
+		for (auto pattern : this->res.patterns_found(file))
+			total += this->res.hits(file, pattern);
+
+	std::vector<std::string> unopened{};
+	uint64_t unopened_size = 0;
+	if (this->res.unopened_files())
+	{
+		for (const auto& p : *this->res.unopened_files())
+		{
+			unopened.push_back(to_utf8(p));
+			unopened_size += unopened.back().size();
+		}
+	}
+
+	BinaryResultHeader header{};
+	std::copy(std::begin(BinaryResultHeader::signature), std::end(BinaryResultHeader::signature), header.magic);
+	header.version = BinaryResultHeader::current_version;
+	header.patterns = patterns;
+	header.files = files;
+	header.positions = total;
+	header.patterns_offset = aligned(sizeof(BinaryResultHeader));
+	header.paths_offset = header.patterns_offset + aligned((patterns + 1) * sizeof(uint64_t) + patterns_size);
+	header.sizes_offset = header.paths_offset + aligned((files + 1) * sizeof(uint64_t) + paths_size);
+	header.index_offset = header.sizes_offset + files * sizeof(uint64_t);
+	header.positions_offset = header.index_offset + (files * patterns + 1) * sizeof(uint64_t);
+	header.context_size = this->res.context_size();
+	header.contexts_offset = header.positions_offset + total * sizeof(uint64_t);
+	header.unopened = unopened.size();
+	header.unopened_offset = header.contexts_offset + aligned(total * 2 * header.context_size);
+	header.max_mismatches = this->res.max_mismatches();
+	header.distances_offset = header.unopened_offset + aligned((header.unopened + 1) * sizeof(uint64_t) + unopened_size);
+	header.truncated_offset = header.distances_offset + aligned(header.max_mismatches != 0 ? total : 0);
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	write_padding(out, sizeof(header));
+
+	uint64_t offset = 0;
+	for (PatternId i = 0; i != patterns; ++i)
+	{
+		write_u64(out, offset);
+		offset += this->res.pattern(i).size();
+	}
+	write_u64(out, offset);
+	for (PatternId i = 0; i != patterns; ++i)
+		out.write(this->res.pattern(i).data(), this->res.pattern(i).size());
+	write_padding(out, (patterns + 1) * sizeof(uint64_t) + patterns_size);
+
+	write_strings(out, paths);
+
+	for (FileId i = 0; i != files; ++i)
+		write_u64(out, this->res.file_size(i));
+
+	offset = 0;
+	for (FileId file = 0; file != files; ++file)
+	{
+		for (PatternId pattern = 0; pattern != patterns; ++pattern)
+		{
+			write_u64(out, offset);
+			offset += this->res.hits(file, pattern);
+		}
+	}
+	write_u64(out, offset);
+
+	// Hits are streamed a pair at a time, so spilled ones are never all loaded at once.
+	std::vector<uint64_t> words{};
+	for (FileId file = 0; file != files; ++file)
+	{
+		for (auto pattern : this->res.patterns_found(file))
+		{
+			words.clear();
+			this->res.for_each_hit(file, pattern, 0, this->res.hits(file, pattern), [&](const MatchHit& hit) {
+				words.push_back(hit.position);
+				if (words.size() == positions_per_block)
+				{
+					out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint64_t));
+					words.clear();
+				}
+			});
+			out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint64_t));
+		}
+	}
+
+	if (header.context_size != 0)
+		this->write_contexts(out);
+	write_padding(out, total * 2 * header.context_size);
+
+	write_strings(out, unopened);
+
+	std::vector<char> buff{};
+	if (header.max_mismatches != 0)
+	{
+		for (FileId file = 0; file != files; ++file)
+		{
+			for (auto pattern : this->res.patterns_found(file))
+			{
+				buff.clear();
+				this->res.for_each_hit(file, pattern, 0, this->res.hits(file, pattern), [&buff](const MatchHit& hit) { buff.push_back(static_cast<char>(hit.distance)); });
+				out.write(buff.data(), buff.size());
+			}
+		}
+		write_padding(out, total);
+	}
+
+	buff.clear();
+	for (FileId file = 0; file != files; ++file)
+		for (PatternId pattern = 0; pattern != patterns; ++pattern)
+			buff.push_back(this->res.truncated(file, pattern) ? 1 : 0);
+	out.write(buff.data(), buff.size());
+	write_padding(out, buff.size());
+}
+void ResultWriter::write_contexts(std::ofstream& out) const
+{
+	auto context_size = this->res.context_size();
+	std::vector<char> buff{};
+	for (FileId file = 0; file != this->res.files_count(); ++file)
+	{
+		for (auto pattern : this->res.patterns_found(file))
+		{
+			buff.clear();
+			this->res.for_each_hit(file, pattern, 0, this->res.hits(file, pattern), [&](const MatchHit& hit) {
+				const auto& context = hit.context;
+				buff.insert(buff.end(), context_size - context.before.size(), 0);
+				buff.insert(buff.end(), context.before.cbegin(), context.before.cend());
+				buff.insert(buff.end(), context.after.cbegin(), context.after.cend());
+				buff.insert(buff.end(), context_size - context.after.size(), 0);
+				if (buff.size() >= write_buffer_size)
+				{
+					out.write(buff.data(), buff.size());
+					buff.clear();
+				}
+			});
+			out.write(buff.data(), buff.size());
+		}
+	}
+}
+std::string ResultWriter::to_utf8(const Path& path)
+{
+	auto u8 = fs::path{ path }.u8string();
+	return std::string(u8.cbegin(), u8.cend());
+}
+void ResultWriter::append_hex(std::vector<char>& out, std::string_view bytes)
+{
+	static constexpr char digits[] = "0123456789abcdef";
+	for (auto ch : bytes)
+	{
+		out.push_back(digits[static_cast<unsigned char>(ch) >> 4]);
+		out.push_back(digits[static_cast<unsigned char>(ch) & 0xf]);
+	}
+}
+void ResultWriter::append_quoted(std::vector<char>& out, std::string_view text) const
+{
+	out.push_back('"');
+	for (auto ch : text)
+	{
+		if (this->format == Format::Csv)
+		{
+			if (ch == '"')
+				out.push_back('"');
+			out.push_back(ch);
+		}
+		else if (ch == '"' || ch == '\\')
+		{
+			out.push_back('\\');
+			out.push_back(ch);
+		}
+		else if (static_cast<unsigned char>(ch) < 0x20)
+		{
+			static constexpr char digits[] = "0123456789abcdef";
+			append_text(out, "\\u00");
+			out.push_back(digits[ch >> 4]);
+			out.push_back(digits[ch & 0xf]);
+		}
+		else
+			out.push_back(ch);
+	}
+	out.push_back('"');
+}
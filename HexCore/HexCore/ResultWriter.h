@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <thread>
+#include "HexCore.h"
+
+// Layout of ResultWriter::Format::Binary. All fields use the host byte order and every
+// section starts on an 8-byte boundary, so the file can be memory-mapped and read in place:
+//   patterns_offset  -> uint64_t[patterns + 1] byte offsets into the pattern bytes that follow
+//   paths_offset     -> uint64_t[files + 1] byte offsets into the UTF-8 paths that follow
+//   sizes_offset     -> uint64_t[files] file sizes
+//   index_offset     -> uint64_t[files * patterns + 1] first position of every (file, pattern)
+//   positions_offset -> uint64_t[positions]
+//   contexts_offset  -> char[positions * 2 * context_size], laid out as in FileMatches
+//   distances_offset -> uint8_t[positions] mismatches of every hit when max_mismatches > 0
+//   unopened_offset  -> uint64_t[unopened + 1] byte offsets into the UTF-8 paths that follow
+//   truncated_offset -> uint8_t[files * patterns], 1 where a hard memory cap dropped hits
+struct BinaryResultHeader
+{
+	static constexpr char signature[4] = { 'H', 'X', 'R', 'S' };
+	static constexpr uint32_t current_version = 5;
+
+	char magic[4];
+	uint32_t version;
+	uint64_t patterns;
+	uint64_t files;
+	uint64_t positions;
+	uint64_t patterns_offset;
+	uint64_t paths_offset;
+	uint64_t index_offset;
+	uint64_t positions_offset;
+	uint64_t context_size;
+	uint64_t sizes_offset;
+	uint64_t contexts_offset;
+	uint64_t unopened;
+	uint64_t unopened_offset;
+	uint64_t max_mismatches;
+	uint64_t distances_offset;
+	uint64_t truncated_offset;
+};
+
+
+class __declspec(dllexport) ResultWriter
+{
+public:
+	enum class Format { Csv, Ndjson, Binary };
+
+	ResultWriter() = delete;
+	ResultWriter(const ResultWriter&) = delete;
+	ResultWriter(ResultWriter&&) = default;
+	~ResultWriter() = default;
+	ResultWriter& operator=(const ResultWriter&) = delete;
+	ResultWriter& operator=(ResultWriter&&) = delete;
+
+	ResultWriter(const SearchRes&, Format);
+
+	void write(const Path&) const;
+	static std::optional<Format> format_by_extension(const Path&) noexcept;
+
+private:
+	// A run of positions (or of their distances or contexts) of one (file, pattern) pair;
+	// text formats are produced in such pieces so that a single huge hit list is still
+	// split between threads. Consecutive blocks are packed into chunks of about the same
+	// number of hits, the unit a worker formats in one go.
+	enum class Section { Positions, Distances, Contexts };
+	struct Block
+	{
+		FileId file;
+		PatternId pattern;
+		size_t first;
+		size_t last;
+		Section section;
+	};
+
+	using Chunk = std::vector<Block>;
+
+	std::vector<Chunk> split_chunks() const;
+	void format_block(const Block&, std::vector<char>&) const;
+	void write_text(std::ofstream&) const;
+	void write_binary(std::ofstream&) const;
+	void write_contexts(std::ofstream&) const;
+	const char* section_end(const Block&) const;
+
+	static std::string to_utf8(const Path&);
+	static void append_hex(std::vector<char>&, std::string_view);
+	void append_quoted(std::vector<char>&, std::string_view) const;
+
+private:
+	const SearchRes& res;
+	Format format;
+	unsigned threads_number = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	std::vector<std::string> paths_utf8{};
+	std::vector<std::string> patterns_hex{};
+};
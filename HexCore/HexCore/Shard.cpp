@@ -0,0 +1,353 @@
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+#include "Shard.h"
+#include "ResultReader.h"
+#include "Trace.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	constexpr std::string_view manifest_signature = "HXSM 1";
+
+	std::string to_utf8(const Path& path)
+	{
+		auto u8 = fs::path{ path }.u8string();
+		return std::string(u8.cbegin(), u8.cend());
+	}
+
+	Path from_utf8(std::string_view str)
+	{
+		return fs::path{ std::u8string(str.cbegin(), str.cend()) }.wstring();
+	}
+
+	std::optional<RawBytes> from_hex(std::string_view hex)
+	{
+		auto digit = [](char ch) -> int {
+			if (ch >= '0' && ch <= '9') return ch - '0';
+			if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+			if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+			return -1;
+		};
+		if (hex.size() % 2 != 0)
+			return {};
+		std::vector<char> bytes(hex.size() / 2);
+		for (size_t i = 0; i != bytes.size(); ++i)
+		{
+			auto high = digit(hex[2 * i]), low = digit(hex[2 * i + 1]);
+			if (high < 0 || low < 0)
+				return {};
+			bytes[i] = static_cast<char>(high << 4 | low);
+		}
+		return RawBytes{ std::move(bytes) };
+	}
+
+#ifdef _WIN32
+	// Quoting that CommandLineToArgvW and the CRT undo exactly.
+	void append_quoted(std::wstring& cmd, const std::wstring& arg)
+	{
+		cmd.push_back(L'"');
+		size_t backslashes = 0;
+		for (auto ch : arg)
+		{
+			if (ch == L'\\')
+			{
+				++backslashes;
+				continue;
+			}
+			cmd.append(ch == L'"' ? 2 * backslashes + 1 : backslashes, L'\\');
+			backslashes = 0;
+			cmd.push_back(ch);
+		}
+		cmd.append(2 * backslashes, L'\\');
+		cmd.push_back(L'"');
+	}
+#endif
+}
+
+void ShardManifest::save(const Path& path) const
+{
+	std::ofstream out{ fs::path{ path }, std::ios::binary | std::ios::trunc };
+	if (!out)
+		throw std::runtime_error("Bad file access");
+
+	static constexpr char digits[] = "0123456789abcdef";
+	out << manifest_signature << '\n';
+	out << "slice " << this->slice_size << '\n';
+	out << "context " << this->context_size << '\n';
+	out << "dedup " << static_cast<int>(this->dedup) << '\n';
+	out << "read " << static_cast<int>(this->read_mode) << '\n';
+	out << "mismatches " << this->max_mismatches << '\n';
+	out << "budget " << this->memory_budget << '\n';
+	out << "policy " << static_cast<int>(this->budget_policy) << '\n';
+	if (!this->spill_directory.empty())
+		out << "spill " << to_utf8(this->spill_directory) << '\n';
+	for (const auto& pattern : this->patterns)
+	{
+		out << "pattern ";
+		for (auto ch : pattern.get())
+			out << digits[static_cast<unsigned char>(ch) >> 4] << digits[static_cast<unsigned char>(ch) & 0xf];
+		out << '\n';
+	}
+	for (const auto& p : this->paths)
+	{
+		auto utf8 = to_utf8(p);
+		if (utf8.find('\n') != std::string::npos)
+			throw std::runtime_error("Path can not be stored in a manifest");
+		out << "path " << utf8 << '\n';
+	}
+
+	out.flush();
+	if (!out)
+		throw std::runtime_error("Bad file access");
+}
+ShardManifest ShardManifest::load(const Path& path)
+{
+	std::ifstream in{ fs::path{ path }, std::ios::binary };
+	if (!in)
+		throw std::runtime_error("Bad file access");
+
+	std::string line{};
+	if (!std::getline(in, line) || line != manifest_signature)
+		throw std::runtime_error("Not a shard manifest");
+
+	ShardManifest manifest{};
+	while (std::getline(in, line))
+	{
+		auto space = line.find(' ');
+		if (space == std::string::npos)
+			throw std::runtime_error("Corrupted shard manifest");
+		std::string_view key{ line.data(), space }, value{ line.data() + space + 1, line.size() - space - 1 };
+		if (key == "path")
+			manifest.paths.push_back(from_utf8(value));
+		else if (key == "pattern")
+		{
+			auto pattern = from_hex(value);
+			if (!pattern)
+				throw std::runtime_error("Corrupted shard manifest");
+			manifest.patterns.push_back(std::move(*pattern));
+		}
+		else if (key == "slice")
+			manifest.slice_size = std::stoull(std::string{ value });
+		else if (key == "context")
+			manifest.context_size = std::stoull(std::string{ value });
+		else if (key == "dedup")
+			manifest.dedup = static_cast<Dedup>(std::stoi(std::string{ value }));
+		else if (key == "read")
+			manifest.read_mode = static_cast<ReadMode>(std::stoi(std::string{ value }));
+		else if (key == "mismatches")
+			manifest.max_mismatches = static_cast<unsigned>(std::stoul(std::string{ value }));
+		else if (key == "budget")
+			manifest.memory_budget = std::stoull(std::string{ value });
+		else if (key == "policy")
+			manifest.budget_policy = static_cast<BudgetPolicy>(std::stoi(std::string{ value }));
+		else if (key == "spill")
+			manifest.spill_directory = from_utf8(value);
+		else
+			throw std::runtime_error("Corrupted shard manifest");
+	}
+
+	return manifest;
+}
+
+ShardCoordinator::ShardCoordinator(Path worker, Path work_dir, unsigned shards)
+	: worker{ std::move(worker) }, work_dir{ std::move(work_dir) }, shards{ std::max(shards, 1u) }
+{
+}
+std::vector<ShardManifest> ShardCoordinator::split(Search& search, size_t slice_size) const
+{
+	// Overlapping roots may have added a file twice; it must go to one shard only.
+	search.sort_paths();
+	std::vector<uintmax_t> sizes(search.paths.size(), 0);
+	for (size_t i = 0; i != sizes.size(); ++i)
+	{
+		std::error_code ec{};
+		auto size = fs::file_size(search.paths[i], ec);
+		sizes[i] = ec ? 0 : size;
+	}
+	std::vector<size_t> order(sizes.size());
+	std::iota(order.begin(), order.end(), size_t{ 0 });
+	std::sort(order.begin(), order.end(), [&sizes](size_t l, size_t r) { return sizes[l] > sizes[r]; });
+
+	// Largest files first, each to the shard with the fewest bytes so far.
+	auto count = std::max<size_t>(std::min<size_t>(this->shards, search.paths.size()), 1);
+	std::vector<ShardManifest> manifests(count);
+	std::vector<uintmax_t> load(count, 0);
+	for (auto i : order)
+	{
+		auto shard = std::distance(load.begin(), std::min_element(load.begin(), load.end()));
+		load[shard] += sizes[i];
+		manifests[shard].paths.push_back(std::move(search.paths[i]));
+	}
+	for (auto& manifest : manifests)
+	{
+		manifest.patterns = search.compiled ? search.compiled->to_list() : search.tofind;
+		manifest.slice_size = slice_size;
+		manifest.context_size = search.context_size;
+		manifest.dedup = search.dedup;
+		manifest.read_mode = search.read_mode;
+		manifest.max_mismatches = search.mismatch_limit;
+		// Every worker is its own process; together they stay within the search's budget.
+		manifest.memory_budget = search.memory_budget != 0 ? std::max<size_t>(search.memory_budget / count, 1) : 0;
+		manifest.budget_policy = search.budget_policy;
+		manifest.spill_directory = search.spill_directory;
+	}
+
+	search.reset();
+	return manifests;
+}
+SearchRes ShardCoordinator::exec_and_reset(Search& search, size_t slice_size) const
+{
+	if (!search.ready())
+		return {};
+
+	auto manifests = this->split(search, slice_size);
+	fs::create_directories(this->work_dir);
+	std::vector<Path> manifest_paths{}, result_paths{};
+	for (size_t i = 0; i != manifests.size(); ++i)
+	{
+		auto base = fs::path{ this->work_dir } / (L"shard_" + std::to_wstring(i));
+		manifest_paths.push_back(base.wstring() + L".hxsm");
+		result_paths.push_back(base.wstring() + L".hxrs");
+		manifests[i].save(manifest_paths.back());
+	}
+
+	std::vector<std::future<std::optional<int>>> futures{};
+	futures.reserve(manifests.size());
+	for (size_t i = 0; i != manifests.size(); ++i)
+		futures.push_back(std::async(std::launch::async, &ShardCoordinator::run_process, this->worker,
+			std::vector<Path>{ Path{ worker_flag }, manifest_paths[i], result_paths[i] }));
+
+	// A shard whose worker failed is reported as unopened files rather than dropped.
+	SearchRes res{ manifests.front().patterns, manifests.front().context_size, manifests.front().max_mismatches };
+	for (size_t i = 0; i != manifests.size(); ++i)
+	{
+		auto code = futures[i].get();
+		bool merged = false;
+		if (code && *code == 0)
+		{
+			try
+			{
+				ResultReader{ result_paths[i] }.append_to(res);
+				merged = true;
+			}
+			catch (const std::exception& e)
+			{
+				std::cerr << e.what();
+			}
+		}
+		if (!merged)
+			for (auto& p : manifests[i].paths)
+				res.add_unopened(std::move(p));
+
+		std::error_code ec{};
+		fs::remove(manifest_paths[i], ec);
+		fs::remove(result_paths[i], ec);
+	}
+
+	return res;
+}
+SearchRes ShardCoordinator::merge(const std::vector<Path>& results)
+{
+	if (results.empty())
+		return {};
+
+	HEXCORE_TRACE_SPAN(span, TracePhase::Merge, results.size());
+	ResultReader first{ results.front() };
+	auto res = first.read();
+	for (auto it = std::next(results.cbegin()); it != results.cend(); ++it)
+		ResultReader{ *it }.append_to(res);
+
+	return res;
+}
+bool ShardCoordinator::run_worker(const Path& manifest_path, const Path& result_path) noexcept
+{
+	try
+	{
+		auto manifest = ShardManifest::load(manifest_path);
+		Search search{};
+		for (auto& pattern : manifest.patterns)
+			search.add_bytes(std::move(pattern));
+		search.paths = std::move(manifest.paths);
+		search.set_context_size(manifest.context_size);
+		search.set_dedup(manifest.dedup);
+		search.set_read_mode(manifest.read_mode);
+		search.set_max_mismatches(manifest.max_mismatches);
+		search.set_memory_budget(manifest.memory_budget, manifest.budget_policy, manifest.spill_directory);
+
+		SearchProgress progress{};
+		auto res = search.exec_and_reset(std::max<size_t>(manifest.slice_size, 1), progress);
+		if (res.patterns_count() == 0)
+			res = SearchRes{ std::move(manifest.patterns), manifest.context_size, manifest.max_mismatches };
+		ResultWriter{ res, ResultWriter::Format::Binary }.write(result_path);
+		// Workers are separate processes; their spans go next to their results.
+		if constexpr (Trace::compiled)
+			Trace::write_chrome_json(result_path + L".trace.json");
+		return true;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what();
+	}
+	catch (...)
+	{
+		std::cerr << "Unexpected error";
+	}
+
+	return false;
+}
+std::optional<int> ShardCoordinator::run_process(Path program, std::vector<Path> args)
+{
+#ifdef _WIN32
+	std::wstring cmd{};
+	append_quoted(cmd, program);
+	for (const auto& arg : args)
+	{
+		cmd.push_back(L' ');
+		append_quoted(cmd, arg);
+	}
+
+	STARTUPINFOW startup{};
+	startup.cb = sizeof(startup);
+	PROCESS_INFORMATION process{};
+	if (!CreateProcessW(program.c_str(), cmd.data(), nullptr, nullptr, FALSE, CREATE_NO_WINDOW, nullptr, nullptr, &startup, &process))
+		return {};
+	WaitForSingleObject(process.hProcess, INFINITE);
+	DWORD code = 1;
+	GetExitCodeProcess(process.hProcess, &code);
+	CloseHandle(process.hThread);
+	CloseHandle(process.hProcess);
+	return static_cast<int>(code);
+#else
+	std::vector<std::string> storage{ fs::path{ program }.string() };
+	for (const auto& arg : args)
+		storage.push_back(fs::path{ arg }.string());
+	std::vector<char*> argv{};
+	for (auto& arg : storage)
+		argv.push_back(arg.data());
+	argv.push_back(nullptr);
+
+	pid_t pid{};
+	if (posix_spawn(&pid, argv.front(), nullptr, nullptr, argv.data(), environ) != 0)
+		return {};
+	int status = 0;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return {};
+	return WEXITSTATUS(status);
+#endif
+}
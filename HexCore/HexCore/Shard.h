@@ -0,0 +1,66 @@
+#pragma once
+#include "HexCore.h"
+
+// One worker's part of a sharded search. Stored as UTF-8 text:
+//   HXSM 1
+//   slice <bytes>
+//   context <bytes>
+//   dedup <Dedup value>
+//   read <ReadMode value>
+//   mismatches <bytes>
+//   budget <bytes>    (0 for no memory budget)
+//   policy <BudgetPolicy value>
+//   spill <utf-8>     (optional; the system temporary directory when absent)
+//   pattern <hex>     (one line per pattern, in PatternId order)
+//   path <utf-8>      (one line per file)
+struct __declspec(dllexport) ShardManifest
+{
+	RawBytesList patterns{};
+	std::vector<Path> paths{};
+	size_t slice_size = 0;
+	size_t context_size = 0;
+	Dedup dedup = Dedup::None;
+	ReadMode read_mode = ReadMode::Buffered;
+	unsigned max_mismatches = 0;
+	size_t memory_budget = 0;
+	BudgetPolicy budget_policy = BudgetPolicy::Spill;
+	Path spill_directory{};
+
+	void save(const Path&) const;
+	static ShardManifest load(const Path&);
+};
+
+// Splits a search between worker processes. Each worker is started as
+//   <worker> --shard-worker <manifest> <result>
+// runs ShardCoordinator::run_worker and writes a binary result file; the coordinator
+// then appends the shard results one after another, so no global sort is needed.
+// The same manifests and result files can be moved between hosts by other means and
+// combined with merge().
+class __declspec(dllexport) ShardCoordinator
+{
+public:
+	static constexpr std::wstring_view worker_flag = L"--shard-worker";
+
+	ShardCoordinator() = delete;
+	ShardCoordinator(const ShardCoordinator&) = delete;
+	ShardCoordinator(ShardCoordinator&&) = default;
+	~ShardCoordinator() = default;
+	ShardCoordinator& operator=(const ShardCoordinator&) = delete;
+	ShardCoordinator& operator=(ShardCoordinator&&) = default;
+
+	ShardCoordinator(Path worker, Path work_dir, unsigned shards);
+
+	std::vector<ShardManifest> split(Search&, size_t) const;
+	SearchRes exec_and_reset(Search&, size_t) const;
+
+	static SearchRes merge(const std::vector<Path>&);
+	static bool run_worker(const Path&, const Path&) noexcept;
+
+private:
+	static std::optional<int> run_process(Path, std::vector<Path>);
+
+private:
+	Path worker;
+	Path work_dir;
+	unsigned shards;
+};
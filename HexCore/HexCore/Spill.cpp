@@ -0,0 +1,158 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "Spill.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	std::atomic<unsigned> store_counter{ 0 };
+
+	unsigned long process_id() noexcept
+	{
+#ifdef _WIN32
+		return static_cast<unsigned long>(GetCurrentProcessId());
+#else
+		return static_cast<unsigned long>(getpid());
+#endif
+	}
+}
+
+SpillStore::SpillStore(Path dir, std::size_t context_size, bool distances) : directory{ std::move(dir) }, context_size{ context_size }, distances{ distances }
+{
+}
+SpillStore::~SpillStore()
+{
+	if (this->path.empty())
+		return;
+	this->file.close();
+	std::error_code ec{};
+	fs::remove(fs::path{ this->path }, ec);
+}
+std::vector<SpillRun> SpillStore::write(const std::vector<SpillHits>& batch)
+{
+	// Records are laid out before the lock is taken; the lock only covers the append.
+	auto size = this->hit_size();
+	auto n = 2 * this->context_size;
+	std::vector<SpillRun> runs{};
+	runs.reserve(batch.size());
+	std::vector<char> records{};
+	for (const auto& hits : batch)
+	{
+		runs.push_back({ records.size(), hits.positions.size() });
+		auto at = records.size();
+		records.resize(at + hits.positions.size() * size);
+		for (std::size_t hit = 0; hit != hits.positions.size(); ++hit, at += size)
+		{
+			std::memcpy(records.data() + at, &hits.positions[hit], sizeof(uintmax_t));
+			if (this->distances)
+				records[at + sizeof(uintmax_t)] = static_cast<char>(hits.distances[hit]);
+			if (n != 0)
+				std::memcpy(records.data() + at + size - n, hits.contexts.data() + hit * n, n);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock{ this->mutex };
+	if (this->path.empty())
+	{
+		auto dir = this->directory.empty() ? fs::temp_directory_path() : fs::path{ this->directory };
+		auto name = L"hexcore_" + std::to_wstring(process_id()) + L"_" + std::to_wstring(store_counter++) + L".spill";
+		this->path = (dir / name).wstring();
+		this->file.open(fs::path{ this->path }, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+		if (!this->file)
+		{
+			this->path.clear();
+			throw std::runtime_error("Cannot create spill file");
+		}
+	}
+
+	this->file.seekp(static_cast<std::streamoff>(this->end));
+	this->file.write(records.data(), static_cast<std::streamsize>(records.size()));
+	if (!this->file)
+		throw std::runtime_error("Spill write failed");
+	for (auto& run : runs)
+		run.offset += this->end;
+	this->end += records.size();
+
+	return runs;
+}
+void SpillStore::read(const SpillRun& run, std::size_t first, std::size_t count, std::vector<uintmax_t>& positions, std::vector<uint8_t>& distances, std::vector<char>& contexts) const
+{
+	if (first > run.count || count > run.count - first)
+		throw std::out_of_range("No such hit");
+
+	auto size = this->hit_size();
+	auto n = 2 * this->context_size;
+	std::vector<char> records(count * size);
+	{
+		std::lock_guard<std::mutex> lock{ this->mutex };
+		this->file.seekg(static_cast<std::streamoff>(run.offset + first * size));
+		this->file.read(records.data(), static_cast<std::streamsize>(records.size()));
+		if (!this->file)
+			throw std::runtime_error("Spill read failed");
+	}
+
+	positions.reserve(positions.size() + count);
+	if (this->distances)
+		distances.reserve(distances.size() + count);
+	if (n != 0)
+		contexts.reserve(contexts.size() + count * n);
+	for (const char* record = records.data(); record != records.data() + records.size(); record += size)
+	{
+		uintmax_t position = 0;
+		std::memcpy(&position, record, sizeof(uintmax_t));
+		positions.push_back(position);
+		if (this->distances)
+			distances.push_back(static_cast<uint8_t>(record[sizeof(uintmax_t)]));
+		if (n != 0)
+			contexts.insert(contexts.end(), record + size - n, record + size);
+	}
+}
+std::size_t SpillStore::hit_size() const noexcept
+{
+	return sizeof(uintmax_t) + (this->distances ? 1 : 0) + 2 * this->context_size;
+}
+
+
+ResultBudget::ResultBudget(std::size_t limit, BudgetPolicy policy, std::shared_ptr<SpillStore> store) : limit{ limit }, batch_size{ std::clamp<std::size_t>(limit / 16, 1, max_batch) }, mode{ policy }, spill{ std::move(store) }
+{
+}
+void ResultBudget::add(std::size_t bytes) noexcept
+{
+	this->used.fetch_add(bytes, std::memory_order_relaxed);
+}
+void ResultBudget::release(std::size_t bytes) noexcept
+{
+	this->used.fetch_sub(bytes, std::memory_order_relaxed);
+}
+bool ResultBudget::fits(std::size_t bytes) const noexcept
+{
+	return this->used.load(std::memory_order_relaxed) + bytes <= this->limit;
+}
+bool ResultBudget::exceeded() const noexcept
+{
+	return !this->fits(0);
+}
+std::size_t ResultBudget::batch() const noexcept
+{
+	return this->batch_size;
+}
+BudgetPolicy ResultBudget::policy() const noexcept
+{
+	return this->mode;
+}
+const std::shared_ptr<SpillStore>& ResultBudget::store() const noexcept
+{
+	return this->spill;
+}
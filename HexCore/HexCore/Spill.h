@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "FileIdentity.h"
+
+// What Search does once the hits it holds in memory reach its budget: Spill moves them to
+// a temporary file, Truncate drops every further hit and marks the (file, pattern) pairs
+// that lost some.
+enum class BudgetPolicy { Spill, Truncate };
+
+// Consecutive hits of one (file, pattern) pair in a SpillStore, sorted by position.
+struct SpillRun
+{
+	uint64_t offset;
+	uint64_t count;
+};
+
+// Hits of one pattern handed to SpillStore::write; distances and contexts are ignored
+// when the store does not keep them.
+struct SpillHits
+{
+	const std::vector<uintmax_t>& positions;
+	const std::vector<uint8_t>& distances;
+	const std::vector<char>& contexts;
+};
+
+// Append-only temporary file of spilled hits, removed when the last SearchRes that refers
+// to it is gone. Every hit is one record: its position, its distance when the search
+// allows mismatches, then its context; so two runs that follow each other in the file
+// read as one. Writes and reads may come from any thread.
+class __declspec(dllexport) SpillStore
+{
+public:
+	SpillStore() = delete;
+	SpillStore(const SpillStore&) = delete;
+	SpillStore(SpillStore&&) = delete;
+	~SpillStore();
+	SpillStore& operator=(const SpillStore&) = delete;
+	SpillStore& operator=(SpillStore&&) = delete;
+
+	// An empty directory stands for the system temporary directory. The file is created by
+	// the first write.
+	SpillStore(Path, std::size_t, bool);
+
+	// Writes the hits of several patterns back to back, one run each, with one append.
+	std::vector<SpillRun> write(const std::vector<SpillHits>&);
+	// Appends the hits [first, first + count) of a run to the given vectors.
+	void read(const SpillRun&, std::size_t, std::size_t, std::vector<uintmax_t>&, std::vector<uint8_t>&, std::vector<char>&) const;
+	std::size_t hit_size() const noexcept;
+
+private:
+	Path directory;
+	Path path{};
+	std::size_t context_size;
+	bool distances;
+	mutable std::mutex mutex{};
+	mutable std::fstream file{};
+	uint64_t end{ 0 };
+};
+
+// Bytes of hits that one search holds in memory, shared by all its threads. Threads count
+// their hits in batches, so the total may run over the limit by what the threads found
+// since their last report. Under Spill a file moves its hits to the store only once it
+// has added batch() bytes since its last spill, which bounds both the number of writes
+// and the number of runs; a file that finishes while the limit is exceeded moves all of
+// its hits. What stays in memory is then the limit plus at most a batch per file being
+// scanned.
+class ResultBudget
+{
+public:
+	// Upper bound of batch(); it is a sixteenth of the limit below that.
+	static constexpr std::size_t max_batch = std::size_t{ 4 } << 20;
+	// Hits of a pattern are spilled once they take this many bytes, or batch() if that
+	// is less; smaller ones wait for the next spill rather than become a run of their own.
+	static constexpr std::size_t min_run = std::size_t{ 1 } << 10;
+
+	ResultBudget() = delete;
+	ResultBudget(const ResultBudget&) = delete;
+	ResultBudget(ResultBudget&&) = delete;
+	~ResultBudget() = default;
+	ResultBudget& operator=(const ResultBudget&) = delete;
+	ResultBudget& operator=(ResultBudget&&) = delete;
+
+	ResultBudget(std::size_t, BudgetPolicy, std::shared_ptr<SpillStore>);
+
+	void add(std::size_t) noexcept;
+	void release(std::size_t) noexcept;
+	bool fits(std::size_t) const noexcept;
+	bool exceeded() const noexcept;
+	std::size_t batch() const noexcept;
+	BudgetPolicy policy() const noexcept;
+	const std::shared_ptr<SpillStore>& store() const noexcept;
+
+private:
+	std::size_t limit;
+	std::size_t batch_size;
+	BudgetPolicy mode;
+	std::shared_ptr<SpillStore> spill;
+	std::atomic<std::size_t> used{ 0 };
+};
@@ -0,0 +1,165 @@
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <atomic>
+#include "Trace.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+	constexpr size_t ring_capacity = 1 << 14;
+
+	const char* phase_name(TracePhase phase) noexcept
+	{
+		switch (phase)
+		{
+		case TracePhase::Enumerate: return "enumerate";
+		case TracePhase::Stat: return "stat";
+		case TracePhase::Open: return "open";
+		case TracePhase::Read: return "read";
+		case TracePhase::Scan: return "scan";
+		case TracePhase::Merge: return "merge";
+		}
+		return "unknown";
+	}
+
+	// Only the owning thread writes; count is published after the event, so the exporter
+	// sees complete events up to it.
+	struct RingBuffer
+	{
+		explicit RingBuffer(unsigned id) : tid{ id }, events(ring_capacity) {}
+
+		unsigned tid;
+		std::vector<TraceEvent> events;
+		std::atomic<uint64_t> count{ 0 };
+	};
+
+	struct Registry
+	{
+		std::mutex mutex{};
+		std::vector<std::unique_ptr<RingBuffer>> buffers{};
+		std::vector<RingBuffer*> free{};
+
+		RingBuffer* acquire()
+		{
+			std::lock_guard<std::mutex> lock{ this->mutex };
+			if (!this->free.empty())
+			{
+				auto buffer = this->free.back();
+				this->free.pop_back();
+				return buffer;
+			}
+			this->buffers.push_back(std::make_unique<RingBuffer>(static_cast<unsigned>(this->buffers.size() + 1)));
+			return this->buffers.back().get();
+		}
+		void release(RingBuffer* buffer) noexcept
+		{
+			std::lock_guard<std::mutex> lock{ this->mutex };
+			this->free.push_back(buffer);
+		}
+	};
+
+	Registry& registry()
+	{
+		static Registry instance{};
+		return instance;
+	}
+
+	struct ThreadSlot
+	{
+		RingBuffer* buffer{ nullptr };
+
+		~ThreadSlot()
+		{
+			if (this->buffer)
+				registry().release(this->buffer);
+		}
+	};
+
+	thread_local ThreadSlot slot{};
+
+	const auto epoch = std::chrono::steady_clock::now();
+}
+
+void Trace::record(const TraceEvent& event) noexcept
+{
+	try
+	{
+		if (!slot.buffer)
+			slot.buffer = registry().acquire();
+	}
+	catch (...)
+	{
+		return;
+	}
+	auto& buffer = *slot.buffer;
+	auto count = buffer.count.load(std::memory_order_relaxed);
+	buffer.events[count % ring_capacity] = event;
+	buffer.count.store(count + 1, std::memory_order_release);
+}
+uint64_t Trace::now() noexcept
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+}
+void Trace::write_chrome_json(const Path& path)
+{
+	std::ofstream out{ fs::path{ path }, std::ios::binary | std::ios::trunc };
+	if (!out)
+		throw std::runtime_error("Bad file access");
+
+	// Chrome expects microseconds; three decimals keep the nanosecond resolution.
+	out << std::fixed << std::setprecision(3);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool comma = false;
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lock{ reg.mutex };
+	for (const auto& buffer : reg.buffers)
+	{
+		auto count = buffer->count.load(std::memory_order_acquire);
+		if (count == 0)
+			continue;
+		out << (comma ? "," : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+			<< ",\"args\":{\"name\":\"HexCore " << buffer->tid << "\"}}";
+		comma = true;
+		auto begin = count > ring_capacity ? count - ring_capacity : 0;
+		for (auto i = begin; i != count; ++i)
+		{
+			const auto& event = buffer->events[i % ring_capacity];
+			out << ",{\"name\":\"" << phase_name(event.phase) << "\",\"cat\":\"hexcore\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+				<< ",\"ts\":" << event.begin_ns / 1000.0 << ",\"dur\":" << (event.end_ns - event.begin_ns) / 1000.0
+				<< ",\"args\":{\"files\":" << event.files << ",\"bytes\":" << event.bytes << "}}";
+		}
+	}
+	out << "]}\n";
+	out.flush();
+	if (!out)
+		throw std::runtime_error("Write failed");
+}
+void Trace::clear() noexcept
+{
+	auto& reg = registry();
+	std::lock_guard<std::mutex> lock{ reg.mutex };
+	for (auto& buffer : reg.buffers)
+		buffer->count.store(0, std::memory_order_relaxed);
+}
+
+
+TraceSpan::TraceSpan(TracePhase phase, uint64_t files, uint64_t bytes) noexcept : event{ phase, Trace::now(), 0, files, bytes }
+{
+}
+TraceSpan::~TraceSpan()
+{
+	this->event.end_ns = Trace::now();
+	Trace::record(this->event);
+}
+void TraceSpan::add(uint64_t files, uint64_t bytes) noexcept
+{
+	this->event.files += files;
+	this->event.bytes += bytes;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include "FileIdentity.h"
+
+// Spans of the search phases, for finding out where a slow scan spends its time. Spans
+// are recorded only when HexCore is built with HEXCORE_TRACE defined; otherwise the
+// HEXCORE_TRACE_* macros expand to nothing and no clock is read. Every thread writes to
+// its own ring buffer, so recording takes no lock; a full buffer overwrites its oldest
+// spans. Buffers of finished threads are kept for the export and reused by new threads.
+enum class TracePhase { Enumerate, Stat, Open, Read, Scan, Merge };
+
+struct TraceEvent
+{
+	TracePhase phase;
+	uint64_t begin_ns;
+	uint64_t end_ns;
+	uint64_t files;
+	uint64_t bytes;
+};
+
+class __declspec(dllexport) Trace
+{
+public:
+#ifdef HEXCORE_TRACE
+	static constexpr bool compiled = true;
+#else
+	static constexpr bool compiled = false;
+#endif
+
+	static void record(const TraceEvent&) noexcept;
+	static uint64_t now() noexcept;
+	// Writes every recorded span in the Chrome trace event format, which chrome://tracing
+	// and Perfetto open. Spans still being recorded by running threads may be left out.
+	static void write_chrome_json(const Path&);
+	// Drops every recorded span; call it between searches, not during one.
+	static void clear() noexcept;
+};
+
+class __declspec(dllexport) TraceSpan
+{
+public:
+	TraceSpan() = delete;
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan(TraceSpan&&) = delete;
+	~TraceSpan();
+	TraceSpan& operator=(const TraceSpan&) = delete;
+	TraceSpan& operator=(TraceSpan&&) = delete;
+
+	explicit TraceSpan(TracePhase, uint64_t files = 0, uint64_t bytes = 0) noexcept;
+
+	void add(uint64_t files, uint64_t bytes) noexcept;
+
+private:
+	TraceEvent event;
+};
+
+#ifdef HEXCORE_TRACE
+#define HEXCORE_TRACE_SPAN(name, ...) TraceSpan name{ __VA_ARGS__ }
+#define HEXCORE_TRACE_ADD(name, files, bytes) name.add(files, bytes)
+#else
+#define HEXCORE_TRACE_SPAN(name, ...) ((void)0)
+#define HEXCORE_TRACE_ADD(name, files, bytes) ((void)0)
+#endif